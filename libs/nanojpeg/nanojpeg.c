@@ -170,6 +170,35 @@ int njGetImageSize(void);
 // image after a njDone() call.
 void njDone(void);
 
+// nj_context_t: An independent decoder state.
+// The functions above all share one global context. The functions below
+// take a context instead, so separate contexts can decode at the same time
+// on different threads. A context is large, so it is always heap allocated.
+typedef struct _nj_ctx nj_context_t;
+
+// njCreateContext: Allocate and initialize a new decoder context.
+// Returns NULL if there is not enough memory.
+nj_context_t* njCreateContext(void);
+
+// njDestroyContext: Free a context along with any image data it still owns.
+void njDestroyContext(nj_context_t* ctx);
+
+// njDecodeContext, njGetWidthContext, njGetHeightContext, njIsColorContext,
+// njGetImageContext, njGetImageSizeContext, njDoneContext: The same as the
+// functions above, using the given context instead of the global one.
+nj_result_t njDecodeContext(nj_context_t* ctx, const void* jpeg, const int size);
+int njGetWidthContext(nj_context_t* ctx);
+int njGetHeightContext(nj_context_t* ctx);
+int njIsColorContext(nj_context_t* ctx);
+unsigned char* njGetImageContext(nj_context_t* ctx);
+int njGetImageSizeContext(nj_context_t* ctx);
+void njDoneContext(nj_context_t* ctx);
+
+// njTakeImageContext: Returns the decoded image data and gives its ownership
+// to the caller, who must free it. The context will no longer free it on
+// njDoneContext() or njDestroyContext().
+unsigned char* njTakeImageContext(nj_context_t* ctx);
+
 #endif//_NANOJPEG_H
 
 
@@ -329,7 +358,10 @@ typedef struct _nj_ctx {
     unsigned char *rgb;
 } nj_context_t;
 
-static nj_context_t nj;
+static nj_context_t njGlobal;
+
+// Every internal function takes the context it works on as ctx
+#define nj (*ctx)
 
 static const char njZZ[64] = { 0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18,
 11, 4, 5, 12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28, 35,
@@ -444,7 +476,7 @@ NJ_INLINE void njColIDCT(const int* blk, unsigned char *out, int stride) {
 #define njThrow(e) do { nj.error = e; return; } while (0)
 #define njCheckError() do { if (nj.error) return; } while (0)
 
-static int njShowBits(int bits) {
+static int njShowBits(nj_context_t* ctx, int bits) {
     unsigned char newbyte;
     if (!bits) return 0;
     while (nj.bufbits < bits) {
@@ -481,23 +513,23 @@ static int njShowBits(int bits) {
     return (nj.buf >> (nj.bufbits - bits)) & ((1 << bits) - 1);
 }
 
-NJ_INLINE void njSkipBits(int bits) {
+NJ_INLINE void njSkipBits(nj_context_t* ctx, int bits) {
     if (nj.bufbits < bits)
-        (void) njShowBits(bits);
+        (void) njShowBits(ctx, bits);
     nj.bufbits -= bits;
 }
 
-NJ_INLINE int njGetBits(int bits) {
-    int res = njShowBits(bits);
-    njSkipBits(bits);
+NJ_INLINE int njGetBits(nj_context_t* ctx, int bits) {
+    int res = njShowBits(ctx, bits);
+    njSkipBits(ctx, bits);
     return res;
 }
 
-NJ_INLINE void njByteAlign(void) {
+NJ_INLINE void njByteAlign(nj_context_t* ctx) {
     nj.bufbits &= 0xF8;
 }
 
-static void njSkip(int count) {
+static void njSkip(nj_context_t* ctx, int count) {
     nj.pos += count;
     nj.size -= count;
     nj.length -= count;
@@ -508,22 +540,22 @@ NJ_INLINE unsigned short njDecode16(const unsigned char *pos) {
     return (pos[0] << 8) | pos[1];
 }
 
-static void njDecodeLength(void) {
+static void njDecodeLength(nj_context_t* ctx) {
     if (nj.size < 2) njThrow(NJ_SYNTAX_ERROR);
     nj.length = njDecode16(nj.pos);
     if (nj.length > nj.size) njThrow(NJ_SYNTAX_ERROR);
-    njSkip(2);
+    njSkip(ctx, 2);
 }
 
-NJ_INLINE void njSkipMarker(void) {
-    njDecodeLength();
-    njSkip(nj.length);
+NJ_INLINE void njSkipMarker(nj_context_t* ctx) {
+    njDecodeLength(ctx);
+    njSkip(ctx, nj.length);
 }
 
-NJ_INLINE void njDecodeSOF(void) {
+NJ_INLINE void njDecodeSOF(nj_context_t* ctx) {
     int i, ssxmax = 0, ssymax = 0;
     nj_component_t* c;
-    njDecodeLength();
+    njDecodeLength(ctx);
     njCheckError();
     if (nj.length < 9) njThrow(NJ_SYNTAX_ERROR);
     if (nj.pos[0] != 8) njThrow(NJ_UNSUPPORTED);
@@ -531,7 +563,7 @@ NJ_INLINE void njDecodeSOF(void) {
     nj.width = njDecode16(nj.pos+3);
     if (!nj.width || !nj.height) njThrow(NJ_SYNTAX_ERROR);
     nj.ncomp = nj.pos[5];
-    njSkip(6);
+    njSkip(ctx, 6);
     switch (nj.ncomp) {
         case 1:
         case 3:
@@ -547,7 +579,7 @@ NJ_INLINE void njDecodeSOF(void) {
         if (!(c->ssy = nj.pos[1] & 15)) njThrow(NJ_SYNTAX_ERROR);
         if (c->ssy & (c->ssy - 1)) njThrow(NJ_UNSUPPORTED);  // non-power of two
         if ((c->qtsel = nj.pos[2]) & 0xFC) njThrow(NJ_SYNTAX_ERROR);
-        njSkip(3);
+        njSkip(ctx, 3);
         nj.qtused |= 1 << c->qtsel;
         if (c->ssx > ssxmax) ssxmax = c->ssx;
         if (c->ssy > ssymax) ssymax = c->ssy;
@@ -571,14 +603,14 @@ NJ_INLINE void njDecodeSOF(void) {
         nj.rgb = (unsigned char*) njAllocMem(nj.width * nj.height * nj.ncomp);
         if (!nj.rgb) njThrow(NJ_OUT_OF_MEM);
     }
-    njSkip(nj.length);
+    njSkip(ctx, nj.length);
 }
 
-NJ_INLINE void njDecodeDHT(void) {
+NJ_INLINE void njDecodeDHT(nj_context_t* ctx) {
     int codelen, currcnt, remain, spread, i, j;
     nj_vlc_code_t *vlc;
-    static unsigned char counts[16];
-    njDecodeLength();
+    unsigned char counts[16];
+    njDecodeLength(ctx);
     njCheckError();
     while (nj.length >= 17) {
         i = nj.pos[0];
@@ -587,7 +619,7 @@ NJ_INLINE void njDecodeDHT(void) {
         i = (i | (i >> 3)) & 3;  // combined DC/AC + tableid value
         for (codelen = 1;  codelen <= 16;  ++codelen)
             counts[codelen - 1] = nj.pos[codelen];
-        njSkip(17);
+        njSkip(ctx, 17);
         vlc = &nj.vlctab[i][0];
         remain = spread = 65536;
         for (codelen = 1;  codelen <= 16;  ++codelen) {
@@ -605,7 +637,7 @@ NJ_INLINE void njDecodeDHT(void) {
                     ++vlc;
                 }
             }
-            njSkip(currcnt);
+            njSkip(ctx, currcnt);
         }
         while (remain--) {
             vlc->bits = 0;
@@ -615,10 +647,10 @@ NJ_INLINE void njDecodeDHT(void) {
     if (nj.length) njThrow(NJ_SYNTAX_ERROR);
 }
 
-NJ_INLINE void njDecodeDQT(void) {
+NJ_INLINE void njDecodeDQT(nj_context_t* ctx) {
     int i;
     unsigned char *t;
-    njDecodeLength();
+    njDecodeLength(ctx);
     njCheckError();
     while (nj.length >= 65) {
         i = nj.pos[0];
@@ -627,42 +659,42 @@ NJ_INLINE void njDecodeDQT(void) {
         t = &nj.qtab[i][0];
         for (i = 0;  i < 64;  ++i)
             t[i] = nj.pos[i + 1];
-        njSkip(65);
+        njSkip(ctx, 65);
     }
     if (nj.length) njThrow(NJ_SYNTAX_ERROR);
 }
 
-NJ_INLINE void njDecodeDRI(void) {
-    njDecodeLength();
+NJ_INLINE void njDecodeDRI(nj_context_t* ctx) {
+    njDecodeLength(ctx);
     njCheckError();
     if (nj.length < 2) njThrow(NJ_SYNTAX_ERROR);
     nj.rstinterval = njDecode16(nj.pos);
-    njSkip(nj.length);
+    njSkip(ctx, nj.length);
 }
 
-static int njGetVLC(nj_vlc_code_t* vlc, unsigned char* code) {
-    int value = njShowBits(16);
+static int njGetVLC(nj_context_t* ctx, nj_vlc_code_t* vlc, unsigned char* code) {
+    int value = njShowBits(ctx, 16);
     int bits = vlc[value].bits;
     if (!bits) { nj.error = NJ_SYNTAX_ERROR; return 0; }
-    njSkipBits(bits);
+    njSkipBits(ctx, bits);
     value = vlc[value].code;
     if (code) *code = (unsigned char) value;
     bits = value & 15;
     if (!bits) return 0;
-    value = njGetBits(bits);
+    value = njGetBits(ctx, bits);
     if (value < (1 << (bits - 1)))
         value += ((-1) << bits) + 1;
     return value;
 }
 
-NJ_INLINE void njDecodeBlock(nj_component_t* c, unsigned char* out) {
+NJ_INLINE void njDecodeBlock(nj_context_t* ctx, nj_component_t* c, unsigned char* out) {
     unsigned char code = 0;
     int value, coef = 0;
     njFillMem(nj.block, 0, sizeof(nj.block));
-    c->dcpred += njGetVLC(&nj.vlctab[c->dctabsel][0], NULL);
+    c->dcpred += njGetVLC(ctx, &nj.vlctab[c->dctabsel][0], NULL);
     nj.block[0] = (c->dcpred) * nj.qtab[c->qtsel][0];
     do {
-        value = njGetVLC(&nj.vlctab[c->actabsel][0], &code);
+        value = njGetVLC(ctx, &nj.vlctab[c->actabsel][0], &code);
         if (!code) break;  // EOB
         if (!(code & 0x0F) && (code != 0xF0)) njThrow(NJ_SYNTAX_ERROR);
         coef += (code >> 4) + 1;
@@ -675,29 +707,29 @@ NJ_INLINE void njDecodeBlock(nj_component_t* c, unsigned char* out) {
         njColIDCT(&nj.block[coef], &out[coef], c->stride);
 }
 
-NJ_INLINE void njDecodeScan(void) {
+NJ_INLINE void njDecodeScan(nj_context_t* ctx) {
     int i, mbx, mby, sbx, sby;
     int rstcount = nj.rstinterval, nextrst = 0;
     nj_component_t* c;
-    njDecodeLength();
+    njDecodeLength(ctx);
     njCheckError();
     if (nj.length < (4 + 2 * nj.ncomp)) njThrow(NJ_SYNTAX_ERROR);
     if (nj.pos[0] != nj.ncomp) njThrow(NJ_UNSUPPORTED);
-    njSkip(1);
+    njSkip(ctx, 1);
     for (i = 0, c = nj.comp;  i < nj.ncomp;  ++i, ++c) {
         if (nj.pos[0] != c->cid) njThrow(NJ_SYNTAX_ERROR);
         if (nj.pos[1] & 0xEE) njThrow(NJ_SYNTAX_ERROR);
         c->dctabsel = nj.pos[1] >> 4;
         c->actabsel = (nj.pos[1] & 1) | 2;
-        njSkip(2);
+        njSkip(ctx, 2);
     }
     if (nj.pos[0] || (nj.pos[1] != 63) || nj.pos[2]) njThrow(NJ_UNSUPPORTED);
-    njSkip(nj.length);
+    njSkip(ctx, nj.length);
     for (mbx = mby = 0;;) {
         for (i = 0, c = nj.comp;  i < nj.ncomp;  ++i, ++c)
             for (sby = 0;  sby < c->ssy;  ++sby)
                 for (sbx = 0;  sbx < c->ssx;  ++sbx) {
-                    njDecodeBlock(c, &c->pixels[((mby * c->ssy + sby) * c->stride + mbx * c->ssx + sbx) << 3]);
+                    njDecodeBlock(ctx, c, &c->pixels[((mby * c->ssy + sby) * c->stride + mbx * c->ssx + sbx) << 3]);
                     njCheckError();
                 }
         if (++mbx >= nj.mbwidth) {
@@ -705,8 +737,8 @@ NJ_INLINE void njDecodeScan(void) {
             if (++mby >= nj.mbheight) break;
         }
         if (nj.rstinterval && !(--rstcount)) {
-            njByteAlign();
-            i = njGetBits(16);
+            njByteAlign(ctx);
+            i = njGetBits(ctx, 16);
             if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != nextrst)) njThrow(NJ_SYNTAX_ERROR);
             nextrst = (nextrst + 1) & 7;
             rstcount = nj.rstinterval;
@@ -733,7 +765,7 @@ NJ_INLINE void njDecodeScan(void) {
 #define CF2B (-11)
 #define CF(x) njClip(((x) + 64) >> 7)
 
-NJ_INLINE void njUpsampleH(nj_component_t* c) {
+NJ_INLINE void njUpsampleH(nj_context_t* ctx, nj_component_t* c) {
     const int xmax = c->width - 3;
     unsigned char *out, *lin, *lout;
     int x, y;
@@ -761,7 +793,7 @@ NJ_INLINE void njUpsampleH(nj_component_t* c) {
     c->pixels = out;
 }
 
-NJ_INLINE void njUpsampleV(nj_component_t* c) {
+NJ_INLINE void njUpsampleV(nj_context_t* ctx, nj_component_t* c) {
     const int w = c->width, s1 = c->stride, s2 = s1 + s1;
     unsigned char *out, *cin, *cout;
     int x, y;
@@ -792,7 +824,7 @@ NJ_INLINE void njUpsampleV(nj_component_t* c) {
 
 #else
 
-NJ_INLINE void njUpsample(nj_component_t* c) {
+NJ_INLINE void njUpsample(nj_context_t* ctx, nj_component_t* c) {
     int x, y, xshift = 0, yshift = 0;
     unsigned char *out, *lin, *lout;
     while (c->width < nj.width) { c->width <<= 1; ++xshift; }
@@ -814,20 +846,20 @@ NJ_INLINE void njUpsample(nj_component_t* c) {
 
 #endif
 
-NJ_INLINE void njConvert(void) {
+NJ_INLINE void njConvert(nj_context_t* ctx) {
     int i;
     nj_component_t* c;
     for (i = 0, c = nj.comp;  i < nj.ncomp;  ++i, ++c) {
         #if NJ_CHROMA_FILTER
             while ((c->width < nj.width) || (c->height < nj.height)) {
-                if (c->width < nj.width) njUpsampleH(c);
+                if (c->width < nj.width) njUpsampleH(ctx, c);
                 njCheckError();
-                if (c->height < nj.height) njUpsampleV(c);
+                if (c->height < nj.height) njUpsampleV(ctx, c);
                 njCheckError();
             }
         #else
             if ((c->width < nj.width) || (c->height < nj.height))
-                njUpsample(c);
+                njUpsample(ctx, c);
         #endif
         if ((c->width < nj.width) || (c->height < nj.height)) njThrow(NJ_INTERNAL_ERR);
     }
@@ -865,52 +897,76 @@ NJ_INLINE void njConvert(void) {
     }
 }
 
-void njInit(void) {
-    njFillMem(&nj, 0, sizeof(nj_context_t));
-}
-
-void njDone(void) {
+void njDoneContext(nj_context_t* ctx) {
     int i;
     for (i = 0;  i < 3;  ++i)
         if (nj.comp[i].pixels) njFreeMem((void*) nj.comp[i].pixels);
     if (nj.rgb) njFreeMem((void*) nj.rgb);
-    njInit();
+    njFillMem(ctx, 0, sizeof(nj_context_t));
 }
 
-nj_result_t njDecode(const void* jpeg, const int size) {
-    njDone();
+nj_context_t* njCreateContext(void) {
+    nj_context_t* ctx = (nj_context_t*) njAllocMem(sizeof(nj_context_t));
+    if (ctx) njFillMem(ctx, 0, sizeof(nj_context_t));
+    return ctx;
+}
+
+void njDestroyContext(nj_context_t* ctx) {
+    if (!ctx) return;
+    njDoneContext(ctx);
+    njFreeMem((void*) ctx);
+}
+
+nj_result_t njDecodeContext(nj_context_t* ctx, const void* jpeg, const int size) {
+    njDoneContext(ctx);
     nj.pos = (const unsigned char*) jpeg;
     nj.size = size & 0x7FFFFFFF;
     if (nj.size < 2) return NJ_NO_JPEG;
     if ((nj.pos[0] ^ 0xFF) | (nj.pos[1] ^ 0xD8)) return NJ_NO_JPEG;
-    njSkip(2);
+    njSkip(ctx, 2);
     while (!nj.error) {
         if ((nj.size < 2) || (nj.pos[0] != 0xFF)) return NJ_SYNTAX_ERROR;
-        njSkip(2);
+        njSkip(ctx, 2);
         switch (nj.pos[-1]) {
-            case 0xC0: njDecodeSOF();  break;
-            case 0xC4: njDecodeDHT();  break;
-            case 0xDB: njDecodeDQT();  break;
-            case 0xDD: njDecodeDRI();  break;
-            case 0xDA: njDecodeScan(); break;
-            case 0xFE: njSkipMarker(); break;
+            case 0xC0: njDecodeSOF(ctx);  break;
+            case 0xC4: njDecodeDHT(ctx);  break;
+            case 0xDB: njDecodeDQT(ctx);  break;
+            case 0xDD: njDecodeDRI(ctx);  break;
+            case 0xDA: njDecodeScan(ctx); break;
+            case 0xFE: njSkipMarker(ctx); break;
             default:
                 if ((nj.pos[-1] & 0xF0) == 0xE0)
-                    njSkipMarker();
+                    njSkipMarker(ctx);
                 else
                     return NJ_UNSUPPORTED;
         }
     }
     if (nj.error != __NJ_FINISHED) return nj.error;
     nj.error = NJ_OK;
-    njConvert();
+    njConvert(ctx);
     return nj.error;
 }
 
-int njGetWidth(void)            { return nj.width; }
-int njGetHeight(void)           { return nj.height; }
-int njIsColor(void)             { return (nj.ncomp != 1); }
-unsigned char* njGetImage(void) { return (nj.ncomp == 1) ? nj.comp[0].pixels : nj.rgb; }
-int njGetImageSize(void)        { return nj.width * nj.height * nj.ncomp; }
+int njGetWidthContext(nj_context_t* ctx)            { return nj.width; }
+int njGetHeightContext(nj_context_t* ctx)           { return nj.height; }
+int njIsColorContext(nj_context_t* ctx)             { return (nj.ncomp != 1); }
+unsigned char* njGetImageContext(nj_context_t* ctx) { return (nj.ncomp == 1) ? nj.comp[0].pixels : nj.rgb; }
+int njGetImageSizeContext(nj_context_t* ctx)        { return nj.width * nj.height * nj.ncomp; }
+
+unsigned char* njTakeImageContext(nj_context_t* ctx) {
+    unsigned char* image = njGetImageContext(ctx);
+    if (nj.ncomp == 1) nj.comp[0].pixels = NULL; else nj.rgb = NULL;
+    return image;
+}
+
+// The original global state entry points, these all use the shared context
+void njInit(void)               { njFillMem(&njGlobal, 0, sizeof(nj_context_t)); }
+void njDone(void)               { njDoneContext(&njGlobal); }
+nj_result_t njDecode(const void* jpeg, const int size) { return njDecodeContext(&njGlobal, jpeg, size); }
+int njGetWidth(void)            { return njGetWidthContext(&njGlobal); }
+int njGetHeight(void)           { return njGetHeightContext(&njGlobal); }
+int njIsColor(void)             { return njIsColorContext(&njGlobal); }
+unsigned char* njGetImage(void) { return njGetImageContext(&njGlobal); }
+int njGetImageSize(void)        { return njGetImageSizeContext(&njGlobal); }
 
 #endif // _NJ_INCLUDE_HEADER_ONLY
@@ -58,4 +58,33 @@ int njGetImageSize(void);
 // image after a njDone() call.
 void njDone(void);
 
+// nj_context_t: An independent decoder state.
+// The functions above all share one global context. The functions below
+// take a context instead, so separate contexts can decode at the same time
+// on different threads. A context is large, so it is always heap allocated.
+typedef struct _nj_ctx nj_context_t;
+
+// njCreateContext: Allocate and initialize a new decoder context.
+// Returns NULL if there is not enough memory.
+nj_context_t* njCreateContext(void);
+
+// njDestroyContext: Free a context along with any image data it still owns.
+void njDestroyContext(nj_context_t* ctx);
+
+// njDecodeContext, njGetWidthContext, njGetHeightContext, njIsColorContext,
+// njGetImageContext, njGetImageSizeContext, njDoneContext: The same as the
+// functions above, using the given context instead of the global one.
+nj_result_t njDecodeContext(nj_context_t* ctx, const void* jpeg, const int size);
+int njGetWidthContext(nj_context_t* ctx);
+int njGetHeightContext(nj_context_t* ctx);
+int njIsColorContext(nj_context_t* ctx);
+unsigned char* njGetImageContext(nj_context_t* ctx);
+int njGetImageSizeContext(nj_context_t* ctx);
+void njDoneContext(nj_context_t* ctx);
+
+// njTakeImageContext: Returns the decoded image data and gives its ownership
+// to the caller, who must free it. The context will no longer free it on
+// njDoneContext() or njDestroyContext().
+unsigned char* njTakeImageContext(nj_context_t* ctx);
+
 #endif//_NANOJPEG_H
\ No newline at end of file
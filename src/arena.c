@@ -0,0 +1,136 @@
+#include "./arena.h"
+
+#ifdef _INSPECT_arena
+#include <stdio.h>
+#endif // _INSPECT_arena
+
+#ifdef _TESTS
+#include <stdio.h>
+#endif // _TESTS
+
+// Internal - Allocate a new block which can contain at least size bytes
+static ArenaBlock* _arena_newBlock(size_t size) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock));
+    block->buffer = malloc(size);
+    block->next = NULL; block->size = size; block->used = 0;
+    #ifdef _INSPECT_arena
+    printf("new arena block %p %li\n", block, size);
+    #endif // _INSPECT_arena
+    return block;
+}
+
+// Internal - Allocate a new arena instance, the first block is allocated straight away
+static Arena* _arena_new(size_t blockSize) {
+    Arena* arena = malloc(sizeof(Arena));
+    arena->blockSize = blockSize;
+    arena->first = arena->current = _arena_newBlock(blockSize);
+    #ifdef _INSPECT_arena
+    printf("new arena %p %li\n", arena, blockSize);
+    #endif // _INSPECT_arena
+    return arena;
+}
+
+// Destroy an arena instance, all of its blocks are freed so every allocation made from it is freed
+void arena_destroy(Arena* arena) {
+    #ifdef _INSPECT_arena
+    printf("destroy arena %p\n", arena);
+    #endif // _INSPECT_arena
+    ArenaBlock* block = arena->first;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block->buffer);
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+// Create a new arena, will allocate blocks of 1MiB to aid with performance
+Arena* arena_new() {
+    return _arena_new(1 << 20); // Default: Allocate 1MiB blocks
+}
+
+// Create a new arena, select the size of each block, allocations larger than this are given a block of their own
+Arena* arena_preAlloc(size_t blockSize) {
+    return _arena_new(blockSize < arena_ALIGNMENT ? arena_ALIGNMENT : blockSize);
+}
+
+// Reset an arena, all blocks are kept and will be allocated from again in the same order
+void arena_reset(Arena* arena) {
+    #ifdef _INSPECT_arena
+    printf("reset arena %p\n", arena);
+    #endif // _INSPECT_arena
+    for (ArenaBlock* block = arena->first; block; block = block->next) block->used = 0;
+    arena->current = arena->first;
+}
+
+// Allocate from the current block, moving to the next block or creating a new one when there is no room
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + arena_ALIGNMENT-1) & ~(size_t)(arena_ALIGNMENT-1);
+    ArenaBlock* block = arena->current;
+
+    // Move along any blocks kept by a reset until one has room
+    while (block->used + size > block->size && block->next) {
+        block = block->next;
+    }
+
+    // No existing block has room, so insert a new one after the current block
+    if (block->used + size > block->size) {
+        ArenaBlock* newBlock = _arena_newBlock(size > arena->blockSize ? size : arena->blockSize);
+        newBlock->next = block->next;
+        block->next = newBlock;
+        block = newBlock;
+    }
+
+    arena->current = block;
+    void* rtn = block->buffer + block->used;
+    block->used += size;
+    return rtn;
+}
+
+#ifdef _TESTS
+// Test a small set of allocations, including one larger than a block and a reset
+void _test_arena() {
+    printf("\n_test_arena\n");
+
+    Arena* arena = arena_preAlloc(64);
+    size_t ary[] = {1,16,17,40,100,3,64};
+
+    // Allocate and fill each size, every allocation must be aligned
+    for (int i = 0; i < 7; i++) {
+        unsigned char* buffer = arena_alloc(arena, ary[i]);
+        for (size_t j = 0; j < ary[i]; j++) buffer[j] = (unsigned char)i;
+        printf("# Alloc %i - %li %li\n", i, ary[i], (size_t)buffer % arena_ALIGNMENT);
+    }
+
+    // Count the blocks before and after a reset, a reset should not create any more
+    int blocks = 0;
+    for (ArenaBlock* block = arena->first; block; block = block->next) blocks++;
+    arena_reset(arena);
+    for (int i = 0; i < 7; i++) arena_alloc(arena, ary[i]);
+    int blocksAfterReset = 0;
+    for (ArenaBlock* block = arena->first; block; block = block->next) blocksAfterReset++;
+    printf("# Blocks %i - %i\n", blocks, blocksAfterReset);
+
+    arena_destroy(arena);
+}
+
+// Test with a very large set of small allocations, multiple times
+void _test_stress_arena() {
+    printf("\n_test_stress_arena\n");
+
+    // Do 250 resets to better time the result, the arena is only created once
+    Arena* arena = arena_new();
+    for (int i = 0; i < 250; i++) {
+        if (i % 25 == 24) printf("# Iteration %i / 250\n", i+1);
+        arena_reset(arena);
+
+        for (int j = 0; j < 200000; j++) {
+            int* value = arena_alloc(arena, sizeof(int)*(1+j%8));
+            *value = j;
+        }
+    }
+
+    arena_destroy(arena);
+}
+#endif // _TESTS
@@ -0,0 +1,45 @@
+#ifndef __H_arena
+#define __H_arena
+
+#include <stdlib.h>
+
+//#define _INSPECT_arena
+//#define _TESTS
+
+// All allocations are rounded up to this so any type can be stored
+#define arena_ALIGNMENT 16
+
+// A single large allocation which smaller allocations are taken from in order
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    unsigned char* buffer;
+} ArenaBlock;
+
+// The arena struct containing its chain of blocks, the block currently being allocated from, and the default block size
+typedef struct Arena {
+    ArenaBlock* first;
+    ArenaBlock* current;
+    size_t blockSize;
+} Arena;
+
+// Allocate a new arena instance, if you can estimate the total size to be allocated then preAlloc is more efficient
+Arena* arena_new();
+Arena* arena_preAlloc(size_t blockSize);
+
+// Destroy an arena instance, every allocation made from it is freed at once
+void arena_destroy(Arena* arena);
+
+// Reset an arena so its blocks can be reused, every allocation made from it becomes invalid but no memory is freed
+void arena_reset(Arena* arena);
+
+// Allocate from the arena, there is no way to free a single allocation, use destroy or reset instead
+void* arena_alloc(Arena* arena, size_t size);
+
+#ifdef _TESTS
+void _test_arena();
+void _test_stress_arena();
+#endif // _TESTS
+
+#endif // __H_arena
@@ -0,0 +1,283 @@
+#include "./gif.h"
+
+#include <string.h>
+
+#ifdef _TESTS
+#include "../libs/lodepng/lodepng.h"
+#endif // _TESTS
+
+// Internal - The number of bits needed for a pallet index, a gif pallet is a power of two with at least two colours
+static unsigned _gif_palletBits(unsigned palletLength) {
+    unsigned bits = 1;
+    while ((1u << bits) < palletLength) bits++;
+    return bits;
+}
+
+// Internal - Append bytes to the output, growing it when it is full
+static void _gif_output(GifEncoder* encoder, const unsigned char* data, size_t length) {
+    if (encoder->outputLength + length > encoder->outputSize) {
+        encoder->outputSize = 2*encoder->outputSize > encoder->outputLength + length ? 2*encoder->outputSize : encoder->outputLength + length;
+        encoder->output = realloc(encoder->output, encoder->outputSize);
+    }
+    memcpy(encoder->output + encoder->outputLength, data, length);
+    encoder->outputLength += length;
+}
+
+// Internal - Move the current sub block to the output, each sub block starts with its length
+static void _gif_flushBlock(GifEncoder* encoder) {
+    if (!encoder->blockLength) return;
+    unsigned char length = (unsigned char)encoder->blockLength;
+    _gif_output(encoder, &length, 1);
+    _gif_output(encoder, encoder->block, encoder->blockLength);
+    encoder->blockLength = 0;
+}
+
+// Internal - Write a code using the current code size, codes are packed with the first bit in the lowest bit of each byte
+static void _gif_writeCode(GifEncoder* encoder, unsigned code) {
+    encoder->bits |= code << encoder->bitCount;
+    encoder->bitCount += encoder->codeSize;
+    while (encoder->bitCount >= 8) {
+        encoder->block[encoder->blockLength++] = (unsigned char)encoder->bits;
+        encoder->bits >>= 8;
+        encoder->bitCount -= 8;
+        if (encoder->blockLength == 255) _gif_flushBlock(encoder);
+    }
+}
+
+// Internal - Empty the dictionary, only the single index codes remain
+static void _gif_clear(GifEncoder* encoder) {
+    memset(encoder->keys, 0, sizeof(encoder->keys));
+    encoder->codeSize = encoder->minCodeSize + 1;
+    encoder->maxCode = encoder->clearCode + 1;
+}
+
+// Allocate a new encoder with an empty output
+GifEncoder* gif_newEncoder() {
+    GifEncoder* encoder = malloc(sizeof(GifEncoder));
+    encoder->output = NULL;
+    encoder->outputLength = encoder->outputSize = 0;
+    return encoder;
+}
+
+// Destroy an encoder, freeing its output
+void gif_destroyEncoder(GifEncoder* encoder) {
+    free(encoder->output);
+    free(encoder);
+}
+
+// The pallet is padded with black to the next power of two, an animation is given the netscape extension so it loops forever
+void gif_writeHeader(FILE* file, unsigned width, unsigned height, const IndexedImage* pallet, int animated) {
+    if (width > 0xFFFF || height > 0xFFFF) {
+        fprintf(stderr, "error: %ux%u is too large for a gif\n", width, height);
+        exit(1);
+    }
+
+    unsigned bits = _gif_palletBits(pallet->palletLength);
+    unsigned char header[13] = {
+        'G', 'I', 'F', '8', '9', 'a',
+        (unsigned char)width, (unsigned char)(width >> 8), (unsigned char)height, (unsigned char)(height >> 8),
+        (unsigned char)(0x80 | (bits-1) << 4 | (bits-1)), 0, 0
+    };
+    fwrite(header, 1, 13, file);
+
+    unsigned char table[images_MAX_PALLET*3] = {0};
+    memcpy(table, pallet->pallet, (size_t)pallet->palletLength*3);
+    fwrite(table, 3, 1u << bits, file);
+
+    if (animated) {
+        static const unsigned char loop[19] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+        fwrite(loop, 1, 19, file);
+    }
+}
+
+// Each frame of an animation is left in place when the next is drawn, the frame header is followed by the clear code which starts the data
+void gif_beginFrame(GifEncoder* encoder, unsigned width, unsigned height, unsigned palletLength, int animated) {
+    if (animated) {
+        unsigned char control[8] = {0x21, 0xF9, 0x04, 0x04, (unsigned char)gif_FRAME_DELAY, (unsigned char)(gif_FRAME_DELAY >> 8), 0, 0};
+        _gif_output(encoder, control, 8);
+    }
+    unsigned char descriptor[10] = {0x2C, 0, 0, 0, 0, (unsigned char)width, (unsigned char)(width >> 8), (unsigned char)height, (unsigned char)(height >> 8), 0};
+    _gif_output(encoder, descriptor, 10);
+
+    // The smallest code size gif allows is 2 bits, even for a pallet of two colours
+    unsigned bits = _gif_palletBits(palletLength);
+    encoder->minCodeSize = bits < 2 ? 2 : bits;
+    unsigned char minCodeSize = (unsigned char)encoder->minCodeSize;
+    _gif_output(encoder, &minCodeSize, 1);
+
+    encoder->clearCode = 1u << encoder->minCodeSize;
+    encoder->prefix = -1;
+    encoder->bits = encoder->bitCount = encoder->blockLength = 0;
+    _gif_clear(encoder);
+    _gif_writeCode(encoder, encoder->clearCode);
+}
+
+// The longest string in the dictionary which matches the indexes is extended one index at a time, each miss writes the code of the match
+// A new code can be one bit wider than the last, and the dictionary is cleared once the largest code has been used
+void gif_encode(GifEncoder* encoder, const unsigned char* indexes, size_t length) {
+    size_t i = 0;
+    if (encoder->prefix < 0 && length) encoder->prefix = indexes[i++];
+    for (; i < length; i++) {
+        unsigned key = (unsigned)encoder->prefix << 8 | indexes[i];
+        unsigned slot = (key * 2654435761u) >> 19;
+        while (encoder->keys[slot] && encoder->keys[slot] != key+1) slot = (slot+1) & (gif_HASH_SIZE-1);
+        if (encoder->keys[slot]) {
+            encoder->prefix = encoder->codes[slot];
+            continue;
+        }
+
+        _gif_writeCode(encoder, (unsigned)encoder->prefix);
+        encoder->keys[slot] = key+1;
+        encoder->codes[slot] = (unsigned short)++encoder->maxCode;
+        if (encoder->maxCode >= (1u << encoder->codeSize)) encoder->codeSize++;
+        if (encoder->maxCode == gif_MAX_CODE) {
+            _gif_writeCode(encoder, encoder->clearCode);
+            _gif_clear(encoder);
+        }
+        encoder->prefix = indexes[i];
+    }
+}
+
+// The last match is written, then the end code and any partial byte, the sub blocks end with one of length 0
+void gif_endFrame(GifEncoder* encoder) {
+    if (encoder->prefix >= 0) {
+        _gif_writeCode(encoder, (unsigned)encoder->prefix);
+
+        // A decoder adds one more code when it reads the last match, which can make the end code one bit wider
+        if (encoder->maxCode+1 >= (1u << encoder->codeSize) && encoder->codeSize < 12) encoder->codeSize++;
+    }
+    _gif_writeCode(encoder, encoder->clearCode+1);
+    if (encoder->bitCount) {
+        encoder->block[encoder->blockLength++] = (unsigned char)encoder->bits;
+        encoder->bits = encoder->bitCount = 0;
+    }
+    _gif_flushBlock(encoder);
+    unsigned char end = 0;
+    _gif_output(encoder, &end, 1);
+}
+
+// Write the output to the file and empty it
+void gif_flush(GifEncoder* encoder, FILE* file) {
+    if (encoder->outputLength) fwrite(encoder->output, 1, encoder->outputLength, file);
+    encoder->outputLength = 0;
+}
+
+// Write the trailer byte
+void gif_writeTrailer(FILE* file) {
+    fputc(0x3B, file);
+}
+
+#ifdef _TESTS
+// Decode the first frame of a gif, returns the number of indexes decoded
+static size_t _test_gif_decode(const unsigned char* data, size_t size, unsigned char* output, size_t outputSize) {
+    // Skip the header, the global pallet, and any extensions to reach the image data
+    size_t position = 13 + 3*((size_t)2 << (data[10] & 7));
+    while (data[position] == 0x21) {
+        position += 2;
+        while (data[position]) position += data[position]+1;
+        position++;
+    }
+    position += 10;
+    unsigned minCodeSize = data[position++];
+
+    // Join the sub blocks into one stream of codes
+    unsigned char* stream = malloc(size);
+    size_t streamLength = 0;
+    while (position < size && data[position]) {
+        memcpy(stream+streamLength, data+position+1, data[position]);
+        streamLength += data[position];
+        position += data[position]+1;
+    }
+
+    // Each code is its prefix code followed by one index, single index codes have no prefix
+    static unsigned short prefixes[4096], lengths[4096];
+    static unsigned char suffixes[4096], firsts[4096];
+    unsigned clearCode = 1u << minCodeSize, codeSize = minCodeSize+1, next = clearCode+2;
+    for (unsigned i = 0; i < clearCode; i++) {
+        lengths[i] = 1; suffixes[i] = firsts[i] = (unsigned char)i;
+    }
+
+    int previous = -1;
+    size_t outputLength = 0;
+    for (size_t bit = 0; bit + codeSize <= streamLength*8;) {
+        unsigned code = 0;
+        for (unsigned i = 0; i < codeSize; i++, bit++) code |= ((stream[bit/8] >> (bit%8)) & 1u) << i;
+        if (code == clearCode) {
+            codeSize = minCodeSize+1; next = clearCode+2; previous = -1;
+            continue;
+        } else if (code == clearCode+1 || code > next || (previous < 0 && code >= clearCode)) {
+            break;
+        }
+
+        // A code can be used as soon as it is defined, in which case it starts with the first index of the previous code
+        if (previous >= 0 && next < 4096) {
+            prefixes[next] = (unsigned short)previous;
+            suffixes[next] = code < next ? firsts[code] : firsts[previous];
+            firsts[next] = firsts[previous];
+            lengths[next] = lengths[previous]+1;
+            next++;
+            if (next == (1u << codeSize) && codeSize < 12) codeSize++;
+        }
+        if (outputLength + lengths[code] > outputSize) break;
+        for (unsigned c = code, i = lengths[code]; i > 0; c = prefixes[c], i--) output[outputLength+i-1] = suffixes[c];
+        outputLength += lengths[code];
+        previous = (int)code;
+    }
+    free(stream);
+    return outputLength;
+}
+
+// Encode random and repetitive index planes for several pallet lengths, feeding them in uneven pieces, then decode them
+// The planes are large enough to fill the dictionary several times, so the clear codes and every code size are used
+#define gifTestWidth 211
+#define gifTestHeight 157
+void _test_gif() {
+    printf("\n_test_gif\n");
+
+    static unsigned char indexes[gifTestWidth*gifTestHeight];
+    static unsigned char decoded[gifTestWidth*gifTestHeight];
+    const size_t length = gifTestWidth*gifTestHeight;
+    const char* path = "_test_gif.gif";
+    unsigned palletLengths[5] = {1, 2, 5, 16, 256};
+
+    GifEncoder* encoder = gif_newEncoder();
+    IndexedImage image = newIndexedImage(gifTestHeight, gifTestWidth);
+    for (int pattern = 0; pattern < 2; pattern++) for (int p = 0; p < 5; p++) {
+        unsigned palletLength = palletLengths[p];
+        for (size_t i = 0; i < length; i++) indexes[i] = (unsigned char)(pattern ? (i/97) % palletLength : (unsigned)rand() % palletLength);
+
+        // Encode straight into the encoder output
+        int errors = 0;
+        image.palletLength = palletLength;
+        FILE* file = fopen(path, "wb");
+        gif_writeHeader(file, gifTestWidth, gifTestHeight, &image, 0);
+        gif_beginFrame(encoder, gifTestWidth, gifTestHeight, palletLength, 0);
+        for (size_t i = 0, piece = 1; i < length; i += piece, piece = piece*3 % 1000 + 1) {
+            gif_encode(encoder, indexes+i, i + piece < length ? piece : length - i);
+        }
+        gif_endFrame(encoder);
+        gif_flush(encoder, file);
+        gif_writeTrailer(file);
+        fclose(file);
+
+        unsigned char* data; size_t size;
+        lodepng_load_file(&data, &size, path);
+        if (_test_gif_decode(data, size, decoded, length) != length || memcmp(decoded, indexes, length) != 0) errors++;
+        if (data[size-1] != 0x3B) errors++;
+        free(data);
+
+        // Write the same indexes as an indexed image, it must decode to the same indexes
+        memcpy(image.buffer, indexes, length);
+        writeIndexedImage(image, path, IMAGE_GIF);
+        lodepng_load_file(&data, &size, path);
+        if (_test_gif_decode(data, size, decoded, length) != length || memcmp(decoded, indexes, length) != 0) errors++;
+        free(data);
+
+        printf("# %s %u colours - Errors %i\n", pattern ? "Runs" : "Random", palletLength, errors);
+    }
+
+    gif_destroyEncoder(encoder);
+    destroyIndexedImage(&image);
+    remove(path);
+}
+#endif // _TESTS
@@ -0,0 +1,67 @@
+#ifndef __H_gif
+#define __H_gif
+
+#include "./images.h"
+#include <stdio.h>
+
+//#define _TESTS
+
+// A GIF89a writer for indexed images, every frame uses the global pallet of the file so no frame carries its own
+// Frames are encoded into a buffer owned by the encoder, so frames can be encoded on separate threads and written in order
+
+// The largest code LZW can use within a gif, the dictionary is cleared once it is full
+#define gif_MAX_CODE 4095
+
+// The dictionary is an open addressed hash of prefix code and index, it only ever holds gif_MAX_CODE entries so it is never more than half full
+#define gif_HASH_SIZE 8192
+
+// The time each frame of an animation is shown for, in hundredths of a second
+#define gif_FRAME_DELAY 10
+
+// The state of the frame being encoded, the bytes written so far are held in output until gif_flush is called
+typedef struct GifEncoder {
+    unsigned minCodeSize;
+    unsigned codeSize;
+    unsigned clearCode;
+    unsigned maxCode;
+    int prefix;
+    unsigned bits;
+    unsigned bitCount;
+    unsigned char block[256];
+    unsigned blockLength;
+    unsigned char* output;
+    size_t outputLength;
+    size_t outputSize;
+    unsigned keys[gif_HASH_SIZE];
+    unsigned short codes[gif_HASH_SIZE];
+} GifEncoder;
+
+// Allocate a new encoder instance, it can encode any number of frames one after another
+GifEncoder* gif_newEncoder();
+
+// Destroy an encoder instance, freeing its output buffer
+void gif_destroyEncoder(GifEncoder* encoder);
+
+// Write the header and global pallet of a gif, an animated gif repeats forever and gives every frame a delay
+void gif_writeHeader(FILE* file, unsigned width, unsigned height, const IndexedImage* pallet, int animated);
+
+// Start a frame at the top left of the image, the pallet length must match the one given to the header
+void gif_beginFrame(GifEncoder* encoder, unsigned width, unsigned height, unsigned palletLength, int animated);
+
+// Encode the next pallet indexes of the frame, the indexes of a frame can be given in any number of pieces
+void gif_encode(GifEncoder* encoder, const unsigned char* indexes, size_t length);
+
+// Finish the frame, every index of the frame must have been given
+void gif_endFrame(GifEncoder* encoder);
+
+// Write everything encoded since the last flush, then empty the output
+void gif_flush(GifEncoder* encoder, FILE* file);
+
+// Write the byte which ends a gif
+void gif_writeTrailer(FILE* file);
+
+#ifdef _TESTS
+void _test_gif();
+#endif // _TESTS
+
+#endif // __H_gif
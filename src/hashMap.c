@@ -3,7 +3,14 @@
 #include <math.h>
 #include <stdio.h>
 
-// Internal - Allocate a new hashmap instance, mapSize must be within PRIME_SIZES
+#ifdef _TESTS
+#include <time.h>
+#endif // _TESTS
+
+// The smallest map which will be allocated, must be a power of 2
+#define hashMap_MIN_SIZE 64
+
+// Internal - Allocate a new hashmap instance, mapSize must be a power of 2
 static HashMap* _hashMap_new(size_t mapSize) {
     HashMap* hashMap = malloc(sizeof(HashMap));
     hashMap->map = calloc(mapSize, sizeof(HashMapElement));
@@ -23,17 +30,39 @@ void hashMap_destroy(HashMap* hashMap) {
     free(hashMap);
 }
 
-// https://planetmath.org/goodhashtableprimes
-static const size_t hashMap_PRIME_SIZES[] = {53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593, 49157, 98317, 196613, 393241, 786433, 1572869};
-static const size_t hashMap_PRIME_SIZES_LENGTH = 16;
-
-// Get the next allowed map size, only primes are allowed because otherwise the probing hash might not visit all indexes
+// Get the smallest power of 2 map size which can hold the desired number of elements without passing the maximum load factor
 static size_t _hashMap_getAllowedSize(size_t mapSize) {
-    size_t i = 0;
-    while (i < hashMap_PRIME_SIZES_LENGTH && hashMap_PRIME_SIZES[i] < mapSize) i++;
-    if (i < hashMap_PRIME_SIZES_LENGTH) return hashMap_PRIME_SIZES[i];
-    printf("error: hash map exceeded maximum allowed size. Desired: %li Max: %li\n", mapSize, hashMap_PRIME_SIZES[i-1]);
-    exit(1);
+    size_t allowedSize = hashMap_MIN_SIZE;
+    while (allowedSize - allowedSize/8 < mapSize) allowedSize *= 2;
+    return allowedSize;
+}
+
+// Mix all bits of the key into the lower bits, the map size is a power of 2 so only the lower bits select the index
+static size_t _hashMap_hash(int key) {
+    unsigned hash = (unsigned)key;
+    hash ^= hash >> 16; hash *= 0x85ebca6bu;
+    hash ^= hash >> 13; hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Internal - Insert an element which is known to not be in the map, starting from index which is element.probe away from its home index
+static void _hashMap_insertNew(HashMap* hashMap, HashMapElement element, size_t index) {
+    size_t mask = hashMap->max-1;
+    HashMapElement* map = hashMap->map;
+
+    // Robin hood: take the place of any element which is closer to its home index than this one
+    for (; map[index].value; element.probe++) {
+        if (map[index].probe < element.probe) {
+            HashMapElement displaced = map[index];
+            map[index] = element;
+            element = displaced;
+        }
+        index = (index+1) & mask;
+    }
+
+    map[index] = element;
+    hashMap->used++;
 }
 
 // Internal - Reorganise the internal map of a hashMap to be twice its current size
@@ -45,12 +74,14 @@ static void _hashMap_reorganise(HashMap* hashMap) {
     // Reference the old map and allocate the new one
     size_t mapSize = hashMap->max;
     HashMapElement* map = hashMap->map;
-    hashMap->used = 0; hashMap->max = _hashMap_getAllowedSize(mapSize+1);
+    hashMap->used = 0; hashMap->max = mapSize*2;
     hashMap->map = calloc(hashMap->max, sizeof(HashMapElement));
 
     // Insert all the elements from the old map
     for (size_t i = 0; i < mapSize; i++) {
-        hashMap_setValue(hashMap, map[i].key, map[i].value);
+        if (!map[i].value) continue;
+        map[i].probe = 0;
+        _hashMap_insertNew(hashMap, map[i], _hashMap_hash(map[i].key) & (hashMap->max-1));
     }
 
     // Free the old map
@@ -59,7 +90,7 @@ static void _hashMap_reorganise(HashMap* hashMap) {
 
 // Create a new hash map of the minimum allowed size, use prealloc if you can estimate the number of elements required
 HashMap* hashMap_new() {
-    return _hashMap_new(hashMap_PRIME_SIZES[0]); // Default: Allocate the minimum allowed
+    return _hashMap_new(hashMap_MIN_SIZE); // Default: Allocate the minimum allowed
 }
 
 // Create a new hash map, will allocate the internal map to beable to contain at least the amount specified
@@ -67,59 +98,42 @@ HashMap* hashMap_preAlloc(size_t mapSize) {
     return _hashMap_new(_hashMap_getAllowedSize(mapSize));
 }
 
-// Hash1 is the inital hash, Hash2 is used as the offset for probing
-#define _hashMap_Hash1(k) ((size_t)abs(k*3141)) // Any largish prime is good here to produce large gaps between similar keys
-#define _hashMap_Hash2(k) (1+k%37) // Must be less than hashMap_PRIME_SIZES[0] to avoid infinite loops
-
-// Set the value of a key in a hash map, uses A La Brent hashing improvement, value can not be NULL because removal is not supported
+// Set the value of a key in a hash map, uses robin hood linear probing, value can not be NULL because removal is not supported
 void hashMap_setValue(HashMap* hashMap, int key, void* value) {
-    // If the load factor is 95% or more, then rebuild the map
-    if (100*hashMap->used/hashMap->max > 95) _hashMap_reorganise(hashMap); // Not using doubles proved to give more consistent performance
+    // If the load factor would pass 87.5%, then rebuild the map at twice the size, there is no upper limit
+    if (hashMap->used >= hashMap->max - hashMap->max/8) _hashMap_reorganise(hashMap);
 
     // Get the inital index for the key
-    size_t index = _hashMap_Hash1(key) % hashMap->max;
+    size_t mask = hashMap->max-1;
+    size_t index = _hashMap_hash(key) & mask;
     HashMapElement* map = hashMap->map;
 
-    // Loop until an empty element is found
-    while (map[index].value && map[index].key != key) {
-        int collisionKey = map[index].key;
-        size_t nextIndex = (index + _hashMap_Hash2(key)) % hashMap->max;
-        size_t collisionIndex = (index + _hashMap_Hash2(collisionKey)) % hashMap->max;
-        if (!map[nextIndex].value || map[collisionIndex].value || map[nextIndex].key == key) {
-            // An empty element was found or the collision could not be moved or this is the key we are setting
-            index = nextIndex;
-        } else {
-            // No empty element was found but the collision can be moved
-            // Move the collision to its next element to make this an empty element
-            map[collisionIndex].key = collisionKey;
-            map[collisionIndex].value = map[index].value;;
-            break;
+    // Loop until the key or an element closer to its home index is found, the key can not be further along than that
+    unsigned probe = 0;
+    for (; map[index].value && map[index].probe >= probe; probe++) {
+        if (map[index].key == key) {
+            // This element contains the key, so set the value
+            map[index].value = value;
+            return;
         }
+        index = (index+1) & mask;
     }
 
-    // Increment the used counter if the key is new
-    if (map[index].key != key) {
-        map[index].key = key;
-        hashMap->used++;
-    }
-
-    // Empty element found, insert the key and value
-    map[index].value = value;
+    // The key is not in the map, so insert it where the search stopped
+    _hashMap_insertNew(hashMap, (HashMapElement){key, probe, value}, index);
 }
 
 // Get the value at a given key in a hashmap
 void* hashMap_getValue(const HashMap* hashMap, int key) {
     // Get the inital index for the key
-    size_t index = _hashMap_Hash1(key) % hashMap->max;
+    size_t mask = hashMap->max-1;
+    size_t index = _hashMap_hash(key) & mask;
     HashMapElement* map = hashMap->map;
 
-    // Loop until an empty element is found
-    while (map[index].value) {
-        if (map[index].key == key) {
-            return map[index].value;
-        } else {
-            index = (index + _hashMap_Hash2(key)) % hashMap->max;
-        }
+    // Loop until an empty element or an element closer to its home index is found
+    for (unsigned probe = 0; map[index].value && map[index].probe >= probe; probe++) {
+        if (map[index].key == key) return map[index].value;
+        index = (index+1) & mask;
     }
 
     // No value was found
@@ -129,9 +143,9 @@ void* hashMap_getValue(const HashMap* hashMap, int key) {
 #ifdef _INSPECT_hashMap
 // Debug - Print to stdout the contents of a hash map
 static void _hashMap_inspect(HashMap* hashMap) {
-    printf("%p %i %i :: ", hashMap, hashMap->max, hashMap->used);
-    for (int i = 0; i < hashMap->max; i++) {
-        if (hashMap->map[i].value) printf("%i %i | ", i, hashMap->map[i].key);
+    printf("%p %li %li :: ", hashMap, hashMap->max, hashMap->used);
+    for (size_t i = 0; i < hashMap->max; i++) {
+        if (hashMap->map[i].value) printf("%li %i %u | ", i, hashMap->map[i].key, hashMap->map[i].probe);
     }
     printf("\n");
 }
@@ -178,6 +192,7 @@ void _test_stress_hashMap() {
         ary[i] = ary[index]; ary[index] = i;
     }
     char* value = "";
+    clock_t start = clock();
 
     // Do 250 setups and teardowns to better time the result
     for (int i = 0; i < 250; i++) {
@@ -202,5 +217,36 @@ void _test_stress_hashMap() {
 
         hashMap_destroy(hashMap);
     }
+
+    printf("# Time %.3fs\n", (double)(clock()-start)/CLOCKS_PER_SEC);
+}
+
+// Test growing well past the largest size allowed by the old prime table, every key must still be found
+#define hashMapLargeSize 4000000
+void _test_large_hashMap() {
+    printf("\n_test_large_hashMap\n");
+
+    HashMap* hashMap = hashMap_new();
+    clock_t start = clock();
+
+    // Use spread out keys so that the mixer is relied upon, values are offset so none are NULL
+    for (int i = 0; i < hashMapLargeSize; i++) {
+        hashMap_setValue(hashMap, i*2654435761u, (void*)(size_t)(i+1));
+    }
+
+    // Get every key back and count any which are missing or wrong
+    int errors = 0;
+    for (int i = 0; i < hashMapLargeSize; i++) {
+        if ((size_t)hashMap_getValue(hashMap, i*2654435761u) != (size_t)(i+1)) errors++;
+    }
+
+    // Keys which were never inserted must not be found
+    for (int i = hashMapLargeSize; i < hashMapLargeSize+1000; i++) {
+        if (hashMap_includes(hashMap, i*2654435761u)) errors++;
+    }
+
+    printf("# Used %li Max %li Errors %i\n", hashMap->used, hashMap->max, errors);
+    printf("# Time %.3fs\n", (double)(clock()-start)/CLOCKS_PER_SEC);
+    hashMap_destroy(hashMap);
 }
 #endif // _TESTS
\ No newline at end of file
@@ -5,13 +5,14 @@
 
 //#define _INSPECT_hashMap
 
-// An element of the hashmap which contains a key value pair
+// An element of the hashmap which contains a key value pair, probe is the distance from the keys home index and fits in the padding
 typedef struct HashMapElement {
     int key;
+    unsigned probe;
     void* value;
 } HashMapElement;
 
-// The hashmap struct containing its internal map and allocation size, as well as the number of elements it contains
+// The hashmap struct containing its internal map and allocation size, as well as the number of elements it contains; max is always a power of 2
 typedef struct HashMap {
     HashMapElement* map;
     size_t used;
@@ -38,6 +39,7 @@ void* hashMap_getValue(const HashMap* hashMap, int key);
 #ifdef _TESTS
 void _test_hashMap();
 void _test_stress_hashMap();
+void _test_large_hashMap();
 #endif // _TESTS
 
 #endif // __H_hashMap
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "./histogram.h"
+#include <string.h>
+
+#ifdef _INSPECT_histogram
+#include <stdio.h>
+#endif // _INSPECT_histogram
+
+#ifdef _TESTS
+#include <stdio.h>
+#endif // _TESTS
+
+// Allocate a new histogram with a zeroed counter for every key
+Histogram* histogram_new() {
+    Histogram* histogram = malloc(sizeof(Histogram));
+    histogram->counts = calloc(histogram_KEYS, sizeof(unsigned));
+    histogram->blocks = calloc(histogram_BLOCKS, sizeof(unsigned char));
+    #ifdef _INSPECT_histogram
+    printf("new histogram %p\n", histogram);
+    #endif // _INSPECT_histogram
+    return histogram;
+}
+
+// Destroy a histogram, freeing its counters and block flags
+void histogram_destroy(Histogram* histogram) {
+    #ifdef _INSPECT_histogram
+    printf("destroy histogram %p\n", histogram);
+    #endif // _INSPECT_histogram
+    free(histogram->counts);
+    free(histogram->blocks);
+    free(histogram);
+}
+
+// Clear the flagged blocks and their flags, an image with few colours only touches a few blocks so this is much cheaper than a new histogram
+void histogram_clear(Histogram* histogram) {
+    #ifdef _INSPECT_histogram
+    printf("clear histogram %p\n", histogram);
+    #endif // _INSPECT_histogram
+    const size_t blockSize = 1 << histogram_BLOCK_BITS;
+    for (size_t block = 0; block < histogram_BLOCKS; block++) {
+        if (!histogram->blocks[block]) continue;
+        memset(histogram->counts + block*blockSize, 0, sizeof(unsigned)*blockSize);
+        histogram->blocks[block] = 0;
+    }
+}
+
+// Merge the counts of another histogram into this one, addition is used so the result does not depend on merge order
+void histogram_merge(Histogram* histogram, const Histogram* other) {
+    const size_t blockSize = 1 << histogram_BLOCK_BITS;
+    for (size_t block = 0; block < histogram_BLOCKS; block++) {
+        if (!other->blocks[block]) continue;
+        histogram->blocks[block] = 1;
+        unsigned* counts = histogram->counts + block*blockSize;
+        const unsigned* otherCounts = other->counts + block*blockSize;
+        for (size_t i = 0; i < blockSize; i++) counts[i] += otherCounts[i];
+    }
+}
+
+// Compact the histogram into a sorted array of unique keys, only blocks which have been flagged are scanned
+size_t histogram_compact(const Histogram* histogram, HistogramEntry** entries) {
+    const size_t blockSize = 1 << histogram_BLOCK_BITS;
+
+    // Count the unique keys first so the entries can be allocated exactly once
+    size_t length = 0;
+    for (size_t block = 0; block < histogram_BLOCKS; block++) {
+        if (!histogram->blocks[block]) continue;
+        const unsigned* counts = histogram->counts + block*blockSize;
+        for (size_t i = 0; i < blockSize; i++) length += counts[i] != 0;
+    }
+
+    // Copy every key with a count into the entries
+    size_t nextIndex = 0;
+    *entries = malloc(sizeof(HistogramEntry)*(length ? length : 1));
+    for (size_t block = 0; block < histogram_BLOCKS; block++) {
+        if (!histogram->blocks[block]) continue;
+        const unsigned* counts = histogram->counts + block*blockSize;
+        for (size_t i = 0; i < blockSize; i++) {
+            if (!counts[i]) continue;
+            (*entries)[nextIndex].key = (int)(block*blockSize + i);
+            (*entries)[nextIndex++].count = counts[i];
+        }
+    }
+
+    #ifdef _INSPECT_histogram
+    printf("compact histogram %p %li\n", histogram, length);
+    #endif // _INSPECT_histogram
+    return length;
+}
+
+#ifdef _TESTS
+// Test a small set of keys, including duplicates and both ends of the key space
+void _test_histogram() {
+    printf("\n_test_histogram\n");
+
+    Histogram* histogram = histogram_new();
+    int ary[] = {5,3,11,7,histogram_KEYS-1,3,0,5,11,4096};
+
+    // Count all the keys
+    for (int i = 0; i < 10; i++) {
+        printf("# Add %i - %i\n", i, ary[i]);
+        histogram_add(histogram, ary[i]);
+    }
+
+    // Get all the unique keys and their counts
+    HistogramEntry* entries;
+    size_t length = histogram_compact(histogram, &entries);
+    for (size_t i = 0; i < length; i++) {
+        printf("# Entry %li - %i %u\n", i, entries[i].key, entries[i].count);
+    }
+    free(entries);
+
+    // Merge the histogram with its self and a histogram with one new key, all counts should double
+    Histogram* other = histogram_new();
+    histogram_add(other, 8191);
+    histogram_merge(histogram, histogram);
+    histogram_merge(histogram, other);
+    length = histogram_compact(histogram, &entries);
+    for (size_t i = 0; i < length; i++) {
+        printf("# Merged %li - %i %u\n", i, entries[i].key, entries[i].count);
+    }
+    free(entries);
+
+    // Clear the histogram and count one key, it should be the only entry
+    histogram_clear(histogram);
+    histogram_add(histogram, 11);
+    length = histogram_compact(histogram, &entries);
+    for (size_t i = 0; i < length; i++) {
+        printf("# Cleared %li - %i %u\n", i, entries[i].key, entries[i].count);
+    }
+
+    free(entries);
+    histogram_destroy(other);
+    histogram_destroy(histogram);
+}
+
+// Test with a very large set of keys, multiple times
+#define histogramArraySize 200000
+void _test_stress_histogram() {
+    printf("\n_test_stress_histogram\n");
+
+    // Generate an array of random keys, duplicates are expected
+    static int ary[histogramArraySize];
+    for (int i = 0; i < histogramArraySize; i++) {
+        ary[i] = (abs(rand()*rand()))%histogram_KEYS;
+    }
+
+    // Do 25 setups and teardowns to better time the result, each one counts the array 25 times
+    for (int i = 0; i < 25; i++) {
+        if (i % 5 == 4) printf("# Iteration %i / 25\n", i+1);
+        Histogram* histogram = histogram_new();
+
+        for (int j = 0; j < 25; j++) {
+            for (int k = 0; k < histogramArraySize; k++) {
+                histogram_add(histogram, ary[k]);
+            }
+        }
+
+        HistogramEntry* entries;
+        histogram_compact(histogram, &entries);
+
+        free(entries);
+        histogram_destroy(histogram);
+    }
+}
+#endif // _TESTS
@@ -0,0 +1,54 @@
+#ifndef __H_histogram
+#define __H_histogram
+
+#include <stdlib.h>
+
+//#define _INSPECT_histogram
+//#define _TESTS
+
+// Every key produced by colour3_hash fits within 24 bits, so a counter can be kept for each one
+#define histogram_KEYS (1 << 24)
+
+// Counters are grouped into blocks, each block has a flag so compaction can skip the unused parts of the key space
+#define histogram_BLOCK_BITS 12
+#define histogram_BLOCKS (histogram_KEYS >> histogram_BLOCK_BITS)
+
+// A unique key and the number of times it was counted, produced during compaction
+typedef struct HistogramEntry {
+    int key;
+    unsigned count;
+} HistogramEntry;
+
+// The histogram struct containing a counter for every possible key and a flag for every block of counters
+typedef struct Histogram {
+    unsigned* counts;
+    unsigned char* blocks;
+} Histogram;
+
+// Allocate a new histogram instance, the counters are zeroed lazily by the allocator so sparse images only touch what they use
+Histogram* histogram_new();
+
+// Destroy a histogram instance, freeing its counters and block flags
+void histogram_destroy(Histogram* histogram);
+
+// Reset every counter to zero so the histogram can be reused, only blocks which were counted into are cleared
+void histogram_clear(Histogram* histogram);
+
+// Count a single occurrence of a key, there is no probing or allocation so this is safe to use for every pixel
+#define histogram_add(h, k) (h)->counts[k]++; (h)->blocks[(k) >> histogram_BLOCK_BITS] = 1;
+
+// Get the number of times a key has been counted
+#define histogram_getCount(h, k) (h)->counts[k]
+
+// Add all the counts from another histogram into this one, only blocks flagged in the other histogram are visited
+void histogram_merge(Histogram* histogram, const Histogram* other);
+
+// Compact all keys with a count into a contiguous array sorted by key, returns the number of entries written
+size_t histogram_compact(const Histogram* histogram, HistogramEntry** entries);
+
+#ifdef _TESTS
+void _test_histogram();
+void _test_stress_histogram();
+#endif // _TESTS
+
+#endif // __H_histogram
@@ -1,91 +1,384 @@
 #include "./images.h"
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define images_MMAP
+#endif
+
+#include "./gif.h"
 #include "../libs/lodepng/lodepng.h"
 #include "../libs/nanojpeg/nanojpeg.h"
 
-// Read a JPEG image from the given path
-static Image readJPEG(const char* path) {    
-    FILE* fp = fopen(path, "rb");
+// A read only view of the whole contents of a file, which is mapped into memory where possible
+typedef struct FileView {
+    const unsigned char* data;
+    size_t size;
+    int mapped;
+} FileView;
+
+// Open a view of a file, the mapping is shared with the page cache so nothing is copied until a page is touched
+// Files which can not be mapped, such as empty files or pipes, are read into a buffer instead, a path of "-" views stdin
+// A file which can not be opened gives an empty view, so one missing file does not end a batch of many
+static FileView openFileView(const char* path) {
+    FileView view = {NULL, 0, 0};
+    int isStdin = strcmp(path, "-") == 0;
+    #ifdef images_MMAP
+    int fd = isStdin ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: %s not found\n", path);
+        return view;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+        void* mapping = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            // Every decoder reads the file from front to back, so the kernel is told to read ahead and drop pages behind
+            posix_madvise(mapping, (size_t)status.st_size, POSIX_MADV_SEQUENTIAL);
+            view = (FileView){mapping, (size_t)status.st_size, 1};
+        }
+    }
+    close(fd);
+    if (view.mapped) return view;
+    #endif
+
+    FILE* fp = isStdin ? stdin : fopen(path, "rb");
     if (!fp) {
-        printf("error: file not found\n");
-        exit(1);
+        fprintf(stderr, "error: %s not found\n", path);
+        return view;
     }
 
-    // Get the file size and allocate an input buffer
-    fseek(fp, 0, SEEK_END);
-    int fileSize = (int) ftell(fp);
-    unsigned char* buffer = malloc(fileSize);
-    fseek(fp, 0, SEEK_SET);
+    // Read until the end of the file, growing the buffer as it fills so the size does not need to be known up front
+    size_t capacity = 1 << 16;
+    unsigned char* buffer = malloc(capacity);
+    size_t read;
+    while ((read = fread(buffer+view.size, 1, capacity-view.size, fp)) > 0) {
+        view.size += read;
+        if (view.size == capacity) buffer = realloc(buffer, capacity *= 2);
+    }
+    if (!isStdin) fclose(fp);
+
+    view.data = buffer;
+    return view;
+}
 
-    // Read the file into the buffer
-    fileSize = (int) fread(buffer, 1, fileSize, fp);
-    fclose(fp);
+// Close a view of a file, unmapping or freeing its contents
+static void closeFileView(FileView* view) {
+    #ifdef images_MMAP
+    if (view->mapped) munmap((void*)view->data, view->size);
+    else free((void*)view->data);
+    #else
+    free((void*)view->data);
+    #endif
+    view->data = NULL;
+    view->size = 0;
+}
 
-    // Decode the jpeg
-    njInit();
-    unsigned error = njDecode(buffer, fileSize);
+// Read a JPEG image from the contents of a file, an empty image is returned if it can not be decoded
+static Image readJPEG(FileView* view) {
+    // Decode the jpeg, each read has its own decoder context so images can be read on separate threads
+    nj_context_t* decoder = njCreateContext();
+    unsigned error = decoder ? njDecodeContext(decoder, view->data, (int)view->size) : NJ_OUT_OF_MEM;
     if (error) {
         switch(error) {
-            case NJ_NO_JPEG: printf("error %u: Not a jpeg image\n", error); break;
-            case NJ_UNSUPPORTED: printf("error %u: Unsupported format\n", error); break;
-            case NJ_OUT_OF_MEM: printf("error %u: Out of memory\n", error); break;
-            case NJ_INTERNAL_ERR: printf("error %u: Internal error with nanojpeg\n", error); break;
-            case NJ_SYNTAX_ERROR: printf("error %u: Syntax error with jpeg file\n", error); break;
-            default: printf("error %u: Unknown Error\n", error); break;
+            case NJ_NO_JPEG: fprintf(stderr, "error %u: Not a jpeg image\n", error); break;
+            case NJ_UNSUPPORTED: fprintf(stderr, "error %u: Unsupported format\n", error); break;
+            case NJ_OUT_OF_MEM: fprintf(stderr, "error %u: Out of memory\n", error); break;
+            case NJ_INTERNAL_ERR: fprintf(stderr, "error %u: Internal error with nanojpeg\n", error); break;
+            case NJ_SYNTAX_ERROR: fprintf(stderr, "error %u: Syntax error with jpeg file\n", error); break;
+            default: fprintf(stderr, "error %u: Unknown Error\n", error); break;
         }
-        exit(1);
+        if (decoder) njDestroyContext(decoder);
+        return (Image){0};
     }
 
-    // Get the details of the image
-    unsigned width = njGetWidth(), height = njGetHeight();
-    unsigned char* image = njGetImage();
-    free(buffer);
-    //njDone(); // This call is not required due to the realloc below
+    // Get the details of the image, ownership of the pixels is taken so the decoder can be destroyed without freeing them
+    unsigned width = njGetWidthContext(decoder), height = njGetHeightContext(decoder);
+    int isColour = njIsColorContext(decoder);
+    unsigned char* image = njTakeImageContext(decoder);
+    njDestroyContext(decoder);
 
-    // Convert from rgb to rgba so it can be written to a png at the end
-    image = realloc(image, width*height*4);
-    for (int i = width*height; i >= 0; i--) {
-        image[i*4+3] = 255; image[i*4+2] = image[i*3+2]; image[i*4+1] = image[i*3+1]; image[i*4] = image[i*3]; 
+    // Colour images are used as decoded, grayscale images are expanded to rgb
+    if (!isColour) {
+        unsigned char* grey = image;
+        image = malloc((size_t)width*height*3);
+        for (size_t i = 0; i < (size_t)width*height; i++) {
+            image[i*3] = image[i*3+1] = image[i*3+2] = grey[i];
+        }
+        free(grey);
     }
 
-    return (Image){ width, height, width*height*4, image };
+    return (Image){ width, height, 3, (size_t)width*3, (size_t)width*height*3, image, NULL, 0 };
 }
 
-// Read a PNG image from the given path
-static Image readPNG(const char* path) {
+// Read a PNG image from the contents of a file, an empty image is returned if it can not be decoded
+static Image readPNG(FileView* view) {
     unsigned width, height;
     unsigned char* image;
 
-    unsigned error = lodepng_decode32_file(&image, &width, &height, path);
+    // The alpha channel is never used, so the image is decoded without it
+    unsigned error = lodepng_decode24(&image, &width, &height, view->data, view->size);
     if(error) {
-        printf("error %u: %s\n", error, lodepng_error_text(error));
-        exit(1);
+        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+        return (Image){0};
+    }
+
+    return (Image){ width, height, 3, (size_t)width*3, (size_t)width*height*3, image, NULL, 0 };
+}
+
+// Read a binary PPM or PAM, the pixels are already in the layout of an image so the image takes the view of the file rather than copying it
+// A mapped view is kept as it is and the image points past the header, a view read into a buffer has its pixels moved over the header
+// An empty image is returned if the header can not be parsed or the file ends early
+static Image readNetpbm(FileView* view) {
+    NetpbmHeader header;
+    if (!parseNetpbmHeader(view->data, view->size, &header)) {
+        fprintf(stderr, "error: not a binary ppm or pam with one byte per channel\n");
+        return (Image){0};
     }
 
-    return (Image){ width, height, width*height*4, image };
+    size_t stride = (size_t)header.width*header.channels;
+    size_t bufferSize = stride*header.height;
+    if (view->size - header.headerSize < bufferSize) {
+        fprintf(stderr, "error: image data ends before the last row\n");
+        return (Image){0};
+    }
+
+    unsigned char* data = (unsigned char*)view->data;
+    Image image = { header.width, header.height, header.channels, stride, bufferSize, data+header.headerSize, NULL, 0 };
+    if (view->mapped) {
+        image.mapping = data;
+        image.mappingSize = view->size;
+    } else {
+        memmove(data, data+header.headerSize, bufferSize);
+        image.buffer = data;
+    }
+
+    // The image now owns the contents of the view, so closing the view releases nothing
+    *view = (FileView){NULL, 0, 0};
+    return image;
 }
 
-// Write a PNG image to the given path
-static void writePNG(Image image, const char* path) {
-    unsigned error = lodepng_encode32_file(path, image.buffer, image.width, image.height);
+// Write a PNG image to an open file, returns 0 if it could not be encoded
+// lodepng expects rows with no padding, so padded rows are first copied into a packed buffer
+static int writePNG(Image image, FILE* file) {
+    size_t rowSize = (size_t)image.width*image.channels;
+    unsigned char* packed = image.buffer;
+    if (image.stride != rowSize) {
+        packed = malloc(rowSize*image.height);
+        for (unsigned y = 0; y < image.height; y++) {
+            memcpy(packed+y*rowSize, imageRow(image, y), rowSize);
+        }
+    }
+
+    LodePNGColorType colourType = image.channels == 3 ? LCT_RGB : LCT_RGBA;
+    unsigned char* png = NULL;
+    size_t pngSize = 0;
+    unsigned error = lodepng_encode_memory(&png, &pngSize, packed, image.width, image.height, colourType, 8);
+    if (!error) fwrite(png, 1, pngSize, file);
+    if (packed != image.buffer) free(packed);
+    free(png);
     if(error) {
-        printf("error %u: %s\n", error, lodepng_error_text(error));
-        exit(1);
+        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+        return 0;
     }
+    return 1;
+}
+
+// Write an indexed image as a pallet PNG, indexes are packed into rows of 1, 2, 4, or 8 bits, returns 0 if it could not be encoded
+// The raw image given to lodepng has no padding between rows, which matches the packing used here
+static int writeIndexedPNG(IndexedImage image, FILE* file) {
+    unsigned bitDepth = image.palletLength <= 2 ? 1 : image.palletLength <= 4 ? 2 : image.palletLength <= 16 ? 4 : 8;
+
+    // The pallet is given for both the raw image and the png so lodepng does not need to convert anything
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.encoder.auto_convert = 0;
+    state.info_raw.colortype = LCT_PALETTE; state.info_raw.bitdepth = bitDepth;
+    state.info_png.color.colortype = LCT_PALETTE; state.info_png.color.bitdepth = bitDepth;
+    for (unsigned i = 0; i < image.palletLength; i++) {
+        const unsigned char* colour = image.pallet+i*3;
+        lodepng_palette_add(&state.info_raw, colour[0], colour[1], colour[2], 255);
+        lodepng_palette_add(&state.info_png.color, colour[0], colour[1], colour[2], 255);
+    }
+
+    // Pack the indexes with the first pixel in the highest bits of each byte
+    size_t length = (size_t)image.width*image.height;
+    unsigned char* packed = image.buffer;
+    if (bitDepth < 8) {
+        unsigned perByte = 8 / bitDepth;
+        packed = calloc(1, (length+perByte-1) / perByte);
+        for (size_t i = 0; i < length; i++) {
+            packed[i/perByte] |= image.buffer[i] << (8 - bitDepth*(i%perByte+1));
+        }
+    }
+
+    unsigned char* png = NULL;
+    size_t pngSize = 0;
+    unsigned error = lodepng_encode(&png, &pngSize, packed, image.width, image.height, &state);
+    if (!error) fwrite(png, 1, pngSize, file);
+    lodepng_state_cleanup(&state);
+    if (packed != image.buffer) free(packed);
+    free(png);
+
+    if(error) {
+        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+        return 0;
+    }
+    return 1;
+}
+
+// Write a PAM image to an open file, padded rows are written one at a time
+static void writePAM(Image image, FILE* file) {
+    writePAMHeader(file, image.width, image.height, image.channels);
+    size_t rowSize = (size_t)image.width*image.channels;
+    if (image.stride == rowSize) {
+        fwrite(image.buffer, rowSize, image.height, file);
+    } else {
+        for (unsigned y = 0; y < image.height; y++) fwrite(imageRow(image, y), 1, rowSize, file);
+    }
+}
+
+// Write an indexed image as an RGB PAM, PAM has no pallet so each row is expanded through the pallet before it is written
+static void writeIndexedPAM(IndexedImage image, FILE* file) {
+    writePAMHeader(file, image.width, image.height, 3);
+    unsigned char* row = malloc((size_t)image.width*3);
+    for (unsigned y = 0; y < image.height; y++) {
+        const unsigned char* indexes = image.buffer + (size_t)y*image.width;
+        for (unsigned x = 0; x < image.width; x++) memcpy(row+x*3, image.pallet+indexes[x]*3, 3);
+        fwrite(row, 3, image.width, file);
+    }
+    free(row);
+}
+
+// Write an indexed image as a RAW file, the index buffer is written as is after the header
+static void writeRaw(IndexedImage image, FILE* file) {
+    writeRawHeader(file, image.width, image.height, &image);
+    fwrite(image.buffer, 1, (size_t)image.width*image.height, file);
+}
+
+// Write an indexed image as a GIF with one frame, the whole index buffer is encoded in one go
+static void writeGIF(IndexedImage image, FILE* file) {
+    gif_writeHeader(file, image.width, image.height, &image, 0);
+    GifEncoder* encoder = gif_newEncoder();
+    gif_beginFrame(encoder, image.width, image.height, image.palletLength, 0);
+    gif_encode(encoder, image.buffer, (size_t)image.width*image.height);
+    gif_endFrame(encoder);
+    gif_flush(encoder, file);
+    gif_destroyEncoder(encoder);
+    gif_writeTrailer(file);
+}
+
+// Internal - Read the next whitespace separated token of a netpbm header, skipping comments
+// The single whitespace character after the token is consumed, for the last header value this is the byte before the pixel data
+static int _images_readToken(const unsigned char* data, size_t size, size_t* position, char* token, size_t tokenSize) {
+    size_t i = *position;
+    while (i < size && (isspace(data[i]) || data[i] == '#')) {
+        if (data[i] == '#') while (i < size && data[i] != '\n') i++;
+        i++;
+    }
+
+    size_t length = 0;
+    while (i < size && !isspace(data[i])) {
+        if (length+1 < tokenSize) token[length++] = (char)data[i];
+        i++;
+    }
+    token[length] = '\0';
+
+    // A token which reaches the end of the data may have been cut short
+    if (i >= size) return 0;
+    *position = i+1;
+    return length > 0;
+}
+
+// Parse either a PPM or PAM header, a PPM header is four values in a fixed order and a PAM header is a list of named values ending with ENDHDR
+int parseNetpbmHeader(const unsigned char* data, size_t size, NetpbmHeader* header) {
+    char token[32];
+    size_t position = 0;
+    unsigned width = 0, height = 0, channels = 0, maxValue = 0;
+    if (!_images_readToken(data, size, &position, token, sizeof(token))) return 0;
+    if (strcmp(token, "P6") == 0) {
+        channels = 3;
+        if (_images_readToken(data, size, &position, token, sizeof(token))) width = (unsigned)atol(token);
+        if (_images_readToken(data, size, &position, token, sizeof(token))) height = (unsigned)atol(token);
+        if (_images_readToken(data, size, &position, token, sizeof(token))) maxValue = (unsigned)atol(token);
+    } else if (strcmp(token, "P7") == 0) {
+        int ended = 0;
+        while (_images_readToken(data, size, &position, token, sizeof(token))) {
+            if (strcmp(token, "ENDHDR") == 0) {
+                ended = 1;
+                break;
+            }
+            char value[32];
+            if (!_images_readToken(data, size, &position, value, sizeof(value))) break;
+            if (strcmp(token, "WIDTH") == 0) width = (unsigned)atol(value);
+            else if (strcmp(token, "HEIGHT") == 0) height = (unsigned)atol(value);
+            else if (strcmp(token, "DEPTH") == 0) channels = (unsigned)atol(value);
+            else if (strcmp(token, "MAXVAL") == 0) maxValue = (unsigned)atol(value);
+        }
+        if (!ended) return 0;
+    }
+
+    // Only one byte per channel is supported, and the alpha of an RGBA image is ignored like every other input
+    if (!width || !height || maxValue != 255 || (channels != 3 && channels != 4)) return 0;
+
+    // The size of the pixel data must fit in a size_t, otherwise a crafted header could wrap it to a size which passes every check on the file
+    if (width > SIZE_MAX / channels / height) return 0;
+    *header = (NetpbmHeader){width, height, channels, position};
+    return 1;
+}
+
+// Write a PAM header, the tuple type tells readers whether the fourth channel is alpha
+void writePAMHeader(FILE* file, unsigned width, unsigned height, unsigned channels) {
+    fprintf(file, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+        width, height, channels, channels == 4 ? "RGB_ALPHA" : "RGB");
+}
+
+// Write a RAW header, the pallet is always written in full so the index plane starts at images_RAW_DATA_OFFSET
+void writeRawHeader(FILE* file, unsigned width, unsigned height, const IndexedImage* pallet) {
+    unsigned char header[images_RAW_DATA_OFFSET] = {0};
+    memcpy(header, images_RAW_MAGIC, 4);
+    unsigned values[3] = {width, height, pallet->palletLength};
+    for (int i = 0; i < 3; i++) {
+        header[4+i*4] = (unsigned char)values[i]; header[5+i*4] = (unsigned char)(values[i] >> 8);
+        header[6+i*4] = (unsigned char)(values[i] >> 16); header[7+i*4] = (unsigned char)(values[i] >> 24);
+    }
+    memcpy(header+16, pallet->pallet, (size_t)pallet->palletLength*3);
+    fwrite(header, 1, images_RAW_DATA_OFFSET, file);
+}
+
+// Get a format from its name, which is also its file extension
+int parseImageFormat(const char* name) {
+    if (strcmp(name, "png") == 0) return IMAGE_PNG;
+    if (strcmp(name, "pam") == 0) return IMAGE_PAM;
+    if (strcmp(name, "raw") == 0) return IMAGE_RAW;
+    if (strcmp(name, "gif") == 0) return IMAGE_GIF;
+    return -1;
+}
+
+// Get the file extension used for a format
+const char* imageFormatExtension(ImageFormat format) {
+    return format == IMAGE_PAM ? "pam" : format == IMAGE_RAW ? "raw" : format == IMAGE_GIF ? "gif" : "png";
 }
 
 // Create a new image with an allocated buffer large enough to store the desired size
 Image newImage(unsigned height, unsigned width) {
-    size_t bufferSize = height*width*4;
+    size_t bufferSize = (size_t)height*width*4;
     unsigned char* buffer = calloc(1, bufferSize);
-    return (Image){width, height, bufferSize, buffer};
+    return (Image){width, height, 4, (size_t)width*4, bufferSize, buffer, NULL, 0};
 }
 
 // Resize the image making sure the internal buffer is large enough to store it
 void resizeImage(Image* image, unsigned height, unsigned width) {
     image->height = height; image->width = width;
-    size_t newBufferSize = height*width*4;
+    image->stride = (size_t)width*image->channels;
+    size_t newBufferSize = image->stride*height;
     if (newBufferSize > image->bufferSize) {
         image->buffer = realloc(image->buffer, newBufferSize);
         image->bufferSize = newBufferSize;
@@ -94,24 +387,158 @@ void resizeImage(Image* image, unsigned height, unsigned width) {
 
 // Destroy an image, deallocating its internal buffer
 void destroyImage(Image* image) {
+    #ifdef images_MMAP
+    if (image->mapping) munmap(image->mapping, image->mappingSize);
+    else free(image->buffer);
+    #else
+    free(image->buffer);
+    #endif
+    image->buffer = NULL;
+    image->bufferSize = 0;
+    image->mapping = NULL;
+    image->mappingSize = 0;
+}
+
+// Create a new indexed image with one byte per pixel and no pallet colours
+IndexedImage newIndexedImage(unsigned height, unsigned width) {
+    IndexedImage image = {0};
+    image.width = width; image.height = height;
+    image.bufferSize = (size_t)height*width;
+    image.buffer = calloc(1, image.bufferSize);
+    return image;
+}
+
+// Resize the indexed image making sure the index buffer is large enough to store it
+void resizeIndexedImage(IndexedImage* image, unsigned height, unsigned width) {
+    image->height = height; image->width = width;
+    size_t newBufferSize = (size_t)height*width;
+    if (newBufferSize > image->bufferSize) {
+        image->buffer = realloc(image->buffer, newBufferSize);
+        image->bufferSize = newBufferSize;
+    }
+}
+
+// Destroy an indexed image, deallocating its index buffer
+void destroyIndexedImage(IndexedImage* image) {
     free(image->buffer);
     image->buffer = NULL;
     image->bufferSize = 0;
 }
 
-// Read either a JPEG or PNG, buffer size is 0 on error
+// Read a JPEG, PNG, PPM, or PAM, buffer size is 0 on error
+// The format is found from the first bytes of the file rather than its name, so images can be read from stdin
+// The file is viewed rather than copied, the decoders read straight from the mapping and a PPM or PAM keeps it as its pixels
 Image readImage(const char* path) {
-    char* fileType = strrchr(path, '.')+1;
-    if (strcmp(fileType, "png") == 0) {
-        return readPNG(path);
-    } else if (strcmp(fileType, "jpeg") == 0 || strcmp(fileType, "jpg") == 0) {
-        return readJPEG(path);
+    FileView view = openFileView(path);
+    const unsigned char* magic = view.data;
+    Image (*decode)(FileView*);
+    if (view.size >= 8 && memcmp(magic, "\x89PNG\r\n\x1A\n", 8) == 0) {
+        decode = readPNG;
+    } else if (view.size >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) {
+        decode = readJPEG;
+    } else if (view.size >= 2 && magic[0] == 'P' && (magic[1] == '6' || magic[1] == '7')) {
+        decode = readNetpbm;
     } else {
-        return (Image){0,0,0,NULL}; 
+        closeFileView(&view);
+        return (Image){0};
     }
+
+    Image image = decode(&view);
+    closeFileView(&view);
+    return image;
 }
 
-// Write a PNG to the given path
-void writeImage(Image image, const char* path) {
-    writePNG(image, path);
-}
\ No newline at end of file
+// Internal - Open a file for writing, NULL is returned if it can not be opened
+static FILE* _images_openOutput(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) fprintf(stderr, "error: could not open %s for writing\n", path);
+    return file;
+}
+
+// Write a PNG or PAM to the given path
+int writeImage(Image image, const char* path, ImageFormat format) {
+    FILE* file = _images_openOutput(path);
+    if (!file) return 0;
+    int written = writeImageFile(image, file, format);
+    fclose(file);
+    return written;
+}
+
+// Write a pallet PNG, an RGB PAM, a RAW, or a GIF to the given path
+int writeIndexedImage(IndexedImage image, const char* path, ImageFormat format) {
+    FILE* file = _images_openOutput(path);
+    if (!file) return 0;
+    int written = writeIndexedImageFile(image, file, format);
+    fclose(file);
+    return written;
+}
+
+// Write a PNG or PAM to an open file, RAW can not hold a full colour image so it is written as a PAM
+int writeImageFile(Image image, FILE* file, ImageFormat format) {
+    if (fullColourFormat(format) != IMAGE_PAM) return writePNG(image, file);
+    writePAM(image, file);
+    return 1;
+}
+
+// Write a pallet PNG, an RGB PAM, a RAW, or a GIF to an open file
+int writeIndexedImageFile(IndexedImage image, FILE* file, ImageFormat format) {
+    if (format == IMAGE_PAM) writeIndexedPAM(image, file);
+    else if (format == IMAGE_RAW) writeRaw(image, file);
+    else if (format == IMAGE_GIF) writeGIF(image, file);
+    else return writeIndexedPNG(image, file);
+    return 1;
+}
+
+#ifdef _TESTS
+// Read a batch of files where only the first is whole, the rest are missing or cut short and must give empty images rather than exiting
+#define imagesTestWidth 19
+#define imagesTestHeight 13
+void _test_images() {
+    printf("\n_test_images\n");
+
+    static unsigned char pixels[imagesTestWidth*imagesTestHeight*3];
+    for (int i = 0; i < imagesTestWidth*imagesTestHeight*3; i++) pixels[i] = (unsigned char)rand();
+    Image source = { imagesTestWidth, imagesTestHeight, 3, imagesTestWidth*3, sizeof(pixels), pixels, NULL, 0 };
+    const char* paths[] = { "_test_images.png", "_test_images_missing.png", "_test_images_short.png", "_test_images_short.jpg", "_test_images_short.pam" };
+    const int pathsLength = sizeof(paths) / sizeof(paths[0]);
+
+    // The whole png is cut in half for the short png, the short pam ends a row early, and the short jpeg is only its first marker
+    writeImage(source, paths[0], IMAGE_PNG);
+    unsigned char* png; size_t pngSize;
+    lodepng_load_file(&png, &pngSize, paths[0]);
+    FILE* file = fopen(paths[2], "wb");
+    fwrite(png, 1, pngSize / 2, file);
+    fclose(file);
+    free(png);
+
+    file = fopen(paths[3], "wb");
+    fwrite("\xFF\xD8\xFF\xE0\x00\x10JFIF", 1, 10, file);
+    fclose(file);
+
+    file = fopen(paths[4], "wb");
+    writePAMHeader(file, imagesTestWidth, imagesTestHeight, 3);
+    fwrite(pixels, 3, imagesTestWidth*(imagesTestHeight-1), file);
+    fclose(file);
+
+    int errors = 0;
+    for (int i = 0; i < pathsLength; i++) {
+        Image image = readImage(paths[i]);
+        if (i == 0) {
+            if (image.width != imagesTestWidth || image.height != imagesTestHeight || image.channels != 3) errors++;
+            else if (memcmp(image.buffer, pixels, sizeof(pixels)) != 0) errors++;
+        } else if (image.bufferSize || image.buffer) {
+            errors++;
+        }
+        destroyImage(&image);
+        remove(paths[i]);
+    }
+    printf("# Read batch with missing and short files - Errors %i\n", errors);
+
+    // A header whose pixel data is larger than a size_t can hold must be rejected rather than wrapping to a small size
+    errors = 0;
+    const char* huge = "P7\nWIDTH 2147483648\nHEIGHT 2147483648\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+    NetpbmHeader header;
+    if (parseNetpbmHeader((const unsigned char*)huge, strlen(huge), &header)) errors++;
+    printf("# Reject overflowing header - Errors %i\n", errors);
+}
+#endif // _TESTS
@@ -2,28 +2,120 @@
 #define __H_images
 
 #include <stdlib.h>
+#include <stdio.h>
+
+//#define _TESTS
 
 // Contains the bitmap data for an image, all image types are converted into this
+// Pixels are either RGB or RGBA depending on channels, and each row starts stride bytes after the one before it
+// A PPM or PAM read from a mapped file has its buffer within the mapping, such an image is read only and the mapping is released when it is destroyed
 typedef struct Image {
     unsigned width;
     unsigned height;
+    unsigned channels;
+    size_t stride;
     size_t bufferSize;
     unsigned char* buffer;
+    void* mapping;
+    size_t mappingSize;
 } Image;
 
-// Create a new image instance with its internal buffer initialised to 0 and of the correct size
+// Get a pointer to the first pixel of a row within an image
+#define imageRow(image, y) ((image).buffer + (size_t)(y)*(image).stride)
+
+// The largest pallet which can be stored within a png, larger pallets must be written as a full colour image
+#define images_MAX_PALLET 256
+
+// Contains one pallet index per pixel and the pallet colours they refer to, this is written as a pallet png
+typedef struct IndexedImage {
+    unsigned width;
+    unsigned height;
+    size_t bufferSize;
+    unsigned char* buffer;
+    unsigned palletLength;
+    unsigned char pallet[images_MAX_PALLET*3];
+} IndexedImage;
+
+// The formats an image can be written as, PAM and RAW are uncompressed so another program can use them without decoding
+// RAW and GIF only hold indexed images, full colour images are written as PAM when RAW is requested and as PNG when GIF is requested
+typedef enum ImageFormat {
+    IMAGE_PNG,
+    IMAGE_PAM,
+    IMAGE_RAW,
+    IMAGE_GIF
+} ImageFormat;
+
+// Get the format a full colour image is written as when the given format is requested
+#define fullColourFormat(format) ((format) == IMAGE_RAW ? IMAGE_PAM : (format) == IMAGE_GIF ? IMAGE_PNG : (format))
+
+// A RAW image is a fixed size header followed by one index byte per pixel, so the index plane is always at the same offset and can be mapped
+// The header is the magic "RCIX", the width, height, and pallet length as little endian 32 bit values, then a 256 entry RGB pallet
+#define images_RAW_MAGIC "RCIX"
+#define images_RAW_DATA_OFFSET (16 + images_MAX_PALLET*3)
+
+// The layout of a binary PPM or PAM, the pixels start headerSize bytes into the file
+typedef struct NetpbmHeader {
+    unsigned width;
+    unsigned height;
+    unsigned channels;
+    size_t headerSize;
+} NetpbmHeader;
+
+// Create a new RGBA image instance with its internal buffer initialised to 0 and of the correct size
 Image newImage(unsigned height, unsigned width);
 
 // Resize the internal buffer of an image instance to be able to fit the new height and width, only ever increases the allocation
+// Images which view a mapping can not be resized
 void resizeImage(Image* image, unsigned height, unsigned width);
 
-// Destroy an image instance, deallocating its internal buffer
+// Destroy an image instance, deallocating its internal buffer or unmapping the file it views
 void destroyImage(Image* image);
 
-// Read in any image from a file
+// Create a new indexed image instance with its index buffer initialised to 0 and an empty pallet
+IndexedImage newIndexedImage(unsigned height, unsigned width);
+
+// Resize the index buffer of an indexed image, only ever increases the allocation
+void resizeIndexedImage(IndexedImage* image, unsigned height, unsigned width);
+
+// Destroy an indexed image instance, deallocating its index buffer
+void destroyIndexedImage(IndexedImage* image);
+
+// Get a format from its name, returns -1 if the name is not a known format
+int parseImageFormat(const char* name);
+
+// Get the file extension used for a format
+const char* imageFormatExtension(ImageFormat format);
+
+// Parse the header at the start of a binary PPM or PAM with one byte per channel and 3 or 4 channels
+// Returns 0 if the data is not a supported image or the header does not end within size bytes
+int parseNetpbmHeader(const unsigned char* data, size_t size, NetpbmHeader* header);
+
+// Write the header of a PAM with one byte per channel, the rows of the image follow it with no padding
+void writePAMHeader(FILE* file, unsigned width, unsigned height, unsigned channels);
+
+// Write the header of a RAW indexed image with the pallet of the indexed image given, the index plane follows it
+void writeRawHeader(FILE* file, unsigned width, unsigned height, const IndexedImage* pallet);
+
+// Read in any image from a file, the format is found from its contents and a path of "-" reads from stdin
+// An empty image, with a buffer size of 0, is returned when the file is missing, truncated, or not a known format
 Image readImage(const char* path);
 
-// Write the image to file as a png
-void writeImage(Image image, const char* path);
+// Write the image to file, RGB images are written without an alpha channel
+// Every writer returns 0 if the file could not be opened or the image could not be encoded, the error has already been reported
+int writeImage(Image image, const char* path, ImageFormat format);
+
+// Write the indexed image to file, as a png this uses the smallest bit depth which fits the pallet and as a PAM the pallet is expanded to RGB
+// As a GIF the image is a single frame using the pallet as its global pallet
+int writeIndexedImage(IndexedImage image, const char* path, ImageFormat format);
+
+// Write the image to a file which is already open, such as stdout, the file is left open so more images can follow
+int writeImageFile(Image image, FILE* file, ImageFormat format);
+
+// Write the indexed image to a file which is already open, the file is left open so more images can follow
+int writeIndexedImageFile(IndexedImage image, FILE* file, ImageFormat format);
+
+#ifdef _TESTS
+void _test_images();
+#endif // _TESTS
 
 #endif // __H_images
\ No newline at end of file
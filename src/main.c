@@ -1,90 +1,176 @@
+#include "./reduce.h"
 #include "./priorityQueue.h"
-#include "./hashMap.h"
+#include "./arena.h"
+#include "./histogram.h"
 #include "./octTree.h"
 #include "./colour3.h"
 #include "./vector3.h"
 #include "./images.h"
+#include "./stream.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 
-typedef struct Node {
-    Colour3 color;
-    Colour3* replacement;
-    int frequency;
-    int recursiveFrequency;
-    #ifdef _DEBUG
-    OctTree* tree;
-    #endif // _DEBUG
-} Node;
-
-void scanImage(Image image, HashMap* colours, OctTree* tree) {
-    for (unsigned i = 0; i < image.height*image.width; i++) {
-        Colour3 color = colour3_fromBuffer(image.buffer, i*4);
-        int key = colour3_hash(color);
-
-        Node* node = hashMap_getValue(colours, key);
-        if (node) {
-            node->frequency++;
-        } else {
-            node = malloc(sizeof(Node));
-            node->color = color; node->replacement = NULL;
-            node->frequency = 1; node->recursiveFrequency = 0;
-            Vector3 vec3 = colour3_toVector3(color);
-            hashMap_setValue(colours, key, node);
-            octTree_setValue(tree, &vec3, node);
-            #ifdef _DEBUG
-            node->tree = octTree_getSubTree(tree, &vec3);
-            #endif
-        }
-    }   
+size_t scanImage(Image image, OctTree* tree, Arena* arena) {
+    // Count every pixel into a dense histogram, this avoids a hash map probe per pixel
+    Histogram* histogram = histogram_new();
+    countPixels(histogram, image, 0, image.height);
+
+    // Compact the histogram into the unique colours and build the tree from them
+    size_t coloursLength = insertColours(histogram, tree, arena);
+    histogram_destroy(histogram);
+    return coloursLength;
 }
 
-int recursiveFrequency(OctTree* tree) {
-    if (!tree->value) return 0;
-    Node* node = tree->value;
-    if (node->recursiveFrequency) return node->recursiveFrequency;
+#ifndef main
+// Streamed images are read in strips of about this many bytes, and remapped into strips with the same number of rows
+#define STRIP_BYTES (1 << 24)
 
-    int frequency = 0, valuesLength = 0, valuesSize = 256;
-    Node** values = malloc(sizeof(Node*)*256);
-    values = (Node**) octTree_values(tree, (void**)values, &valuesLength, &valuesSize);
-    for (int i = 0; i < valuesLength; i++) {
-        frequency += values[i]->frequency;
-    }
+int desiredColourSortCmp(const void* a, const void* b) {
+    return *(int*)a - *(int*)b;
+}
 
-    node->recursiveFrequency = frequency;
-    return frequency;
+// Open an output given on the command line, "-" is stdout and "fd:N" is a file descriptor which the caller has already opened
+FILE* openOutput(const char* target) {
+    FILE* file;
+    if (strcmp(target, "-") == 0) file = stdout;
+    else if (strncmp(target, "fd:", 3) == 0) file = fdopen(atoi(target+3), "wb");
+    else file = fopen(target, "wb");
+    if (!file) fprintf(stderr, "error invalid output: could not open '%s' for writing\n", target);
+    return file;
 }
 
-void selectNodes(OctTree* tree, OctTree* selected[], int* selectedLength, int selectedSize) {
-    PriorityQueue* queue = priorityQueue_preAlloc(selectedSize*8);
-    priorityQueue_push(queue, recursiveFrequency(tree), tree);
-
-    OctTree* children[8];
-    int childrenLength = 0;
-    while (*selectedLength < selectedSize && priorityQueue_hasNext(queue)) {
-        OctTree* nextTree = priorityQueue_pop(queue);
-        childrenLength = octTree_getChildren(nextTree, children);
-        for (int i = 0; i < childrenLength; i++) {
-            priorityQueue_push(queue, recursiveFrequency(children[i]), children[i]);
+// Take the output given for a desired colour count, a count which was given more than once takes its outputs in the order they were given
+FILE* takeOutput(int desired, int givenColours[], FILE* outputs[], int taken[], int length) {
+    for (int i = 0; i < length; i++) {
+        if (givenColours[i] == desired && !taken[i]) {
+            taken[i] = 1;
+            return outputs[i];
         }
-        selected[(*selectedLength)++] = nextTree;
     }
+    return NULL;
 }
 
-#ifndef main
-#define PALLET_SCALE 4
+// Reduce an image without ever holding all of it in memory, the first pass counts its colours and each output is a further pass
+// Memory use is bounded by the strip size, the histogram, and the index table rather than the size of the image
+int streamReduce(char* inputPath, ImageFormat format, int desiredColours[], int desiredColoursLength, int maxDesired) {
+    StreamReader* reader = streamReader_open(inputPath);
+    if (!reader) {
+        fprintf(stderr, "error invalid argument 1: streaming requires a binary ppm or pam image\n");
+        return 1;
+    }
 
-int desiredColourSortCmp(const void* a, const void* b) {
-    return *(int*)a - *(int*)b;
+    // Pixel counts are held as unsigned and ranked with int priorities when selecting, so larger images would overflow them
+    if ((unsigned long long)reader->width*reader->height > INT_MAX) {
+        fprintf(stderr, "error invalid argument 1: streaming can reduce at most %i pixels, got %ix%i\n", INT_MAX, reader->height, reader->width);
+        streamReader_close(reader);
+        return 1;
+    }
+    unsigned stripRows = STRIP_BYTES / ((size_t)reader->width*reader->channels);
+    if (stripRows == 0) stripRows = 1;
+    Image strip = streamReader_newStrip(reader, stripRows);
+
+    // Count every pixel a strip at a time, then build the tree from the unique colours
+    OctTree tree;
+    Arena* arena = arena_new();
+    Histogram* histogram = histogram_new();
+    while (streamReader_read(reader, &strip, stripRows)) {
+        countPixels(histogram, strip, 0, strip.height);
+    }
+    size_t coloursLength = insertColours(histogram, &tree, arena);
+    histogram_destroy(histogram);
+    printf("Read %ix%i pixels containing %li unique colours\n", reader->height, reader->width, coloursLength);
+
+    // Select the nodes to be used, these nodes will later be used to generate the pallet
+    int selectedLength = 0;
+    unsigned* selected = malloc(sizeof(unsigned)*maxDesired);
+    int* owners = malloc(sizeof(int)*maxDesired);
+    selectNodes(&tree, selected, owners, &selectedLength, maxDesired);
+
+    // The remapped strips are written as soon as they are made, so the outputs only need to be as tall as a strip
+    Image pallet = newImage(0, 0);
+    IndexedImage indexed = newIndexedImage(stripRows, reader->width);
+    Image output = newImage(0, 0);
+    char* outputPath = malloc(strlen(inputPath)+32);
+    strcpy(outputPath, inputPath);
+    char* outputFileExtension = strrchr(outputPath, '.');
+    if (!outputFileExtension) outputFileExtension = outputPath + strlen(outputPath);
+
+    Refinement* refinement = refinement_new(&tree, selected, owners, selectedLength);
+    qsort(desiredColours, desiredColoursLength, sizeof(int), desiredColourSortCmp);
+    int failed = 0;
+    for (int desiredColourIndex = 0; desiredColourIndex < desiredColoursLength; desiredColourIndex++) {
+        int desired = desiredColours[desiredColourIndex];
+        if (desired > selectedLength) desired = selectedLength; // Only trigged if desired is greater than the total number of colours in the image
+        refinement_refine(refinement, desired);
+        drawPallet(refinement, &pallet, desired);
+
+        // Read the image again, remapping each strip and passing its rows straight to the output
+        int isIndexed = desired <= images_MAX_PALLET;
+        if (isIndexed) copyPallet(refinement, &indexed);
+        else resizeImage(&output, stripRows, reader->width);
+        sprintf(outputFileExtension, "_reduced_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(isIndexed ? format : fullColourFormat(format)));
+        StreamWriter* writer = streamWriter_open(outputPath, format, reader->width, reader->height, isIndexed ? 1 : 4, &indexed);
+        streamReader_rewind(reader);
+        while (streamReader_read(reader, &strip, stripRows)) {
+            if (isIndexed) {
+                remapIndexes(refinement, strip, indexed, 0, strip.height);
+                streamWriter_write(writer, indexed.buffer, indexed.width, strip.height);
+            } else {
+                remapPixels(refinement, strip, output, 0, strip.height);
+                streamWriter_write(writer, output.buffer, output.stride, strip.height);
+            }
+        }
+        streamWriter_close(writer);
+        printf("Wrote %s\n", outputPath);
+
+        sprintf(outputFileExtension, "_pallet_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(fullColourFormat(format)));
+        if (writeImage(pallet, outputPath, format)) printf("Wrote %s\n", outputPath);
+        else failed++;
+    }
+
+    // Release the strips and the pallet, then the tree in one go
+    streamReader_close(reader);
+    destroyImage(&strip);
+    destroyImage(&output);
+    destroyIndexedImage(&indexed);
+    destroyImage(&pallet);
+    refinement_destroy(refinement);
+    arena_destroy(arena);
+    free(selected);
+    free(owners);
+    free(outputPath);
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
+    // Options come before the arguments, -s streams the image rather than reading all of it into memory and -f selects the output format
+    // -o gives a comma separated output for each desired colour count, which is a path, "-" for stdout, or "fd:N" for an open file descriptor
+    int streaming = 0;
+    ImageFormat format = IMAGE_PNG;
+    char* outputArgument = NULL;
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (strcmp(argv[1], "-s") == 0) {
+            streaming = 1;
+        } else if (strcmp(argv[1], "-f") == 0 && argc > 2 && parseImageFormat(argv[2]) >= 0) {
+            format = (ImageFormat)parseImageFormat(argv[2]);
+            argv++; argc--;
+        } else if (strcmp(argv[1], "-o") == 0 && argc > 2) {
+            outputArgument = argv[2];
+            argv++; argc--;
+        } else {
+            fprintf(stderr, "usage: %s [-s] [-f png|pam|raw|gif] [-o outputs] input colours\n", argv[0]);
+            return 1;
+        }
+        argv++; argc--;
+    }
+
     // Check that exactly two arguments were given
     if (argc != 3) {
-        printf("error: wrong number of arguments, 2 expect got %i\n", argc);
+        fprintf(stderr, "error: wrong number of arguments, 2 expect got %i\n", argc);
         return 1;
     }
 
@@ -97,7 +183,7 @@ int main(int argc, char** argv) {
         int value = atoi(token);
         desiredColours[desiredColoursLength++] = value;
         if (value <= 0) {
-            printf("error invalid argument 2: must be integer greater than 0, got: '%s'\n", token);
+            fprintf(stderr, "error invalid argument 2: must be integer greater than 0, got: '%s'\n", token);
             return 1;
         } else if (value > maxDesired) {
             maxDesired = value; // New maximum value
@@ -107,15 +193,50 @@ int main(int argc, char** argv) {
 
     // If token is not null then we ran out of room in the colours array
     if (token) {
-        printf("error invalid argument 2: can only contain a maximum of 16 different reductions at once\n");
+        fprintf(stderr, "error invalid argument 2: can only contain a maximum of 16 different reductions at once\n");
         return 1;
     }
 
+    // An input of "-" is read from stdin, without any outputs given every reduced image is then written to stdout
     char* inputPath = argv[1];
+    int fromStdin = strcmp(inputPath, "-") == 0;
+    if (streaming) {
+        if (fromStdin || outputArgument) {
+            fprintf(stderr, "error: streaming needs an input file which can be read twice and writes its outputs next to it\n");
+            return 1;
+        }
+        return streamReduce(inputPath, format, desiredColours, desiredColoursLength, maxDesired);
+    }
+
+    // Outputs are matched to the desired colour counts in the order they were given, as the counts are sorted later
+    int givenColours[16];
+    FILE* outputs[16];
+    int taken[16] = {0};
+    int useOutputs = outputArgument || fromStdin;
+    memcpy(givenColours, desiredColours, sizeof(desiredColours));
+    for (int i = 0; i < desiredColoursLength; i++) outputs[i] = stdout;
+    if (outputArgument) {
+        int outputsLength = 1;
+        for (char* c = outputArgument; *c; c++) if (*c == ',') outputsLength++;
+        if (outputsLength != desiredColoursLength) {
+            fprintf(stderr, "error invalid outputs: expected one output for each of the %i desired colour counts\n", desiredColoursLength);
+            return 1;
+        }
+        token = strtok(outputArgument, ",");
+        for (int i = 0; i < outputsLength; i++) {
+            if (!token || !(outputs[i] = openOutput(token))) return 1;
+            token = strtok(NULL, ",");
+        }
+    }
+
+    // Progress is reported on stderr when an image is written to stdout, so it does not end up in the image data
+    FILE* progress = stdout;
+    for (int i = 0; useOutputs && i < desiredColoursLength; i++) if (outputs[i] == stdout) progress = stderr;
+
     // Get the file type so we can read in the image correctly
     Image image = readImage(inputPath);
     if (!image.bufferSize) {
-        printf("error invalid argument 1: file type can not be decoded, must be one of: png, jpeg, jpg\n");
+        fprintf(stderr, "error invalid argument 1: file can not be read or decoded, must be one of: png, jpeg, jpg, ppm, pam\n");
         return 1;
     }
 
@@ -123,109 +244,86 @@ int main(int argc, char** argv) {
         All arguments have been validated beyond this section
     */
 
-    // Allocate space for the colour map and colour tree
-    HashMap* colours = hashMap_preAlloc(image.width*image.height/9);
-    OctTree tree = octTree_new(vector3_new(128, 128, 128), 128);
+    // Allocate space for the colour tree, the arena holds all of its arrays
+    OctTree tree;
+    Arena* arena = arena_new();
 
     // Create a pallet with an internal buffer large enough for largest pallet
-    int maxPalletSize = PALLET_SCALE*(int)ceil(sqrt(maxDesired));
+    int maxPalletSize = reduce_PALLET_SCALE*(int)ceil(sqrt(maxDesired));
     Image pallet = newImage(maxPalletSize, maxPalletSize);
 
-    // Copy the input path and image so it can be modified
-    char outputPath[256];
+    // Copy the input path so it can be modified, with room for the longest suffix
+    char* outputPath = malloc(strlen(inputPath)+32);
     strcpy(outputPath, inputPath);
-    Image output = newImage(image.height, image.width);
+    // Pallets which fit within a png are written as one index per pixel, the full colour output is only allocated if it is needed
+    IndexedImage indexed = newIndexedImage(image.height, image.width);
+    Image output = newImage(0, 0);
     char* outputFileExtension = strrchr(outputPath, '.');
+    if (!outputFileExtension) outputFileExtension = outputPath + strlen(outputPath);
 
-    // Scan the image for all colours, inserting them into the map and tree
-    scanImage(image, colours, &tree);
-    printf("Read %ix%i pixels containing %li unique colours\n", image.height, image.width, colours->used);
+    // Scan the image for all colours, inserting them into the tree
+    size_t coloursLength = scanImage(image, &tree, arena);
+    fprintf(progress, "Read %ix%i pixels containing %li unique colours\n", image.height, image.width, coloursLength);
 
     // Select the nodes to be used, these nodes will later be used to generate the pallet
     int selectedLength = 0;
-    HashMap* excludeMap = hashMap_preAlloc(maxDesired);
-    OctTree** selected = malloc(sizeof(OctTree*)*maxDesired);
-    selectNodes(&tree, selected, &selectedLength, maxDesired);
-
-    // For optimisation reasons, allocate values outside the loops and sort the desired colours array
-    int previousDesired = 0;
-    int valuesLength = 0, valuesSize = 256;
-    Node** values = malloc(sizeof(Node*)*256);
+    unsigned* selected = malloc(sizeof(unsigned)*maxDesired);
+    int* owners = malloc(sizeof(int)*maxDesired);
+    selectNodes(&tree, selected, owners, &selectedLength, maxDesired);
+
+    // The pallet is refined from one desired size to the next, so sort the desired colours array
+    // An output which can not be written is reported and the rest are still written, the exit status is then non-zero
+    Refinement* refinement = refinement_new(&tree, selected, owners, selectedLength);
     qsort(desiredColours, desiredColoursLength, sizeof(int), desiredColourSortCmp);
+    int failed = 0;
     for (int desiredColourIndex = 0; desiredColourIndex < desiredColoursLength; desiredColourIndex++) {
         int desired = desiredColours[desiredColourIndex];
         if (desired > selectedLength) desired = selectedLength; // Only trigged if desired is greater than the total number of colours in the image
 
-        // Create a hash map set of those selected nodes, using a set here greatly improves performance
-        for (int i = previousDesired; i < desired; i++) hashMap_setValue(excludeMap, octTree_pointerHash(selected[i]), HashMap_SetElementExists);
-
-        // Create an image for the pallet output
-        int palletSize = PALLET_SCALE*(int)ceil(sqrt(desired));
-        resizeImage(&pallet, palletSize, palletSize);
-
-        // Find the replacement colour for every node
-        for (int index = 0; index < desired; index++) {
-            OctTree* next = selected[index];
-            Node* node = next->value;
-
-            // Allocate the replacement colour
-            if (index >= previousDesired)
-                node->replacement = malloc(sizeof(Colour3));
-            Colour3* replacement = node->replacement;
-
-            // Initiate the count and sum from the root node
-            int count = node->frequency;
-            Vector3 sum = colour3_toVector3(node->color);
-            vector3_scale(&sum, count);
-
-            // For all descendants, set their replacement colour and add their frequencies
-            valuesLength = 0;
-            values = (Node**) octTree_valuesExcluding(next, excludeMap, (void**)values, &valuesLength, &valuesSize);
-            for (int i = 0; i < valuesLength; i++) {
-                Node* childNode = values[i];
-                childNode->replacement = replacement;
-                Vector3 vec3 = colour3_toVector3(childNode->color);
-                vector3_add_scaled(&sum, &vec3, childNode->frequency);
-                count += childNode->frequency;
-            }
+        // Grow the pallet, only the selections added since the previous size and the colours they own are updated
+        refinement_refine(refinement, desired);
+        drawPallet(refinement, &pallet, desired);
 
-            // Calculate the weighted average
-            vector3_divide(&sum, count);
-            Colour3 colour = colour3_fromVector3(sum);
-            *replacement = colour;
-
-            // Add the colour to the pallet image
-            int row = PALLET_SCALE*((index*PALLET_SCALE) / pallet.width);
-            int column = (index*PALLET_SCALE) % pallet.width;
-            for (int ri = 0; ri < PALLET_SCALE; ri++) for (int ci = 0; ci < PALLET_SCALE; ci++) {
-                int idx = ((row+ri)*pallet.width+column+ci)*4;
-                colour3_toBufferWithAlpha(colour, pallet.buffer, idx, 255);
-            }
+        // For each pixel in the input, copy the replacement colour or its pallet index into the output using the index table
+        int isIndexed = desired <= images_MAX_PALLET;
+        if (isIndexed) {
+            copyPallet(refinement, &indexed);
+            remapIndexes(refinement, image, indexed, 0, image.height);
+        } else {
+            resizeImage(&output, image.height, image.width);
+            remapPixels(refinement, image, output, 0, image.height);
         }
 
-        // For each pixel in the input, copy the replacement colour into the output
-        for (unsigned i = 0; i < image.height*image.width; i++) {
-            Colour3 color = colour3_fromBuffer(image.buffer, i*4);
-            Node* node = hashMap_getValue(colours, colour3_hash(color));
-            
-            Colour3 replacement = *node->replacement;
-            colour3_toBufferWithAlpha(replacement, output.buffer, i*4, 255);
+        // Only the reduced image is written to an output given on the command line, it is flushed so a reader can use it straight away
+        if (useOutputs) {
+            FILE* file = takeOutput(desiredColours[desiredColourIndex], givenColours, outputs, taken, desiredColoursLength);
+            int written = isIndexed ? writeIndexedImageFile(indexed, file, format) : writeImageFile(output, file, format);
+            fflush(file);
+            if (written) fprintf(progress, "Wrote %i colours\n", desiredColours[desiredColourIndex]);
+            else failed++;
+            continue;
         }
 
         // Edit the file name to end in "_reduced" followed by the colour count
         // desiredColours[desiredColourIndex] is used in case selectedLength is smaller
-        sprintf(outputFileExtension, "_reduced_%i.png", desiredColours[desiredColourIndex]);
-        writeImage(output, outputPath);
-        printf("Wrote %s\n", outputPath);
+        sprintf(outputFileExtension, "_reduced_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(isIndexed ? format : fullColourFormat(format)));
+        int written = isIndexed ? writeIndexedImage(indexed, outputPath, format) : writeImage(output, outputPath, format);
+        if (written) printf("Wrote %s\n", outputPath);
+        else failed++;
 
         // Edit the file name to end in "_pallet" followed by the colour count
-        sprintf(outputFileExtension, "_pallet_%i.png", desiredColours[desiredColourIndex]);
-        writeImage(pallet, outputPath);
-        printf("Wrote %s\n", outputPath);
-
-        previousDesired = desiredColours[desiredColourIndex];
+        sprintf(outputFileExtension, "_pallet_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(fullColourFormat(format)));
+        if (writeImage(pallet, outputPath, format)) printf("Wrote %s\n", outputPath);
+        else failed++;
     }
 
-    return 0;
+    // Close the outputs given on the command line, stdout is left for the runtime to close
+    for (int i = 0; outputArgument && i < desiredColoursLength; i++) if (outputs[i] != stdout) fclose(outputs[i]);
+
+    // Release the pallet, then the tree in one go
+    refinement_destroy(refinement);
+    arena_destroy(arena);
+
+    return failed ? 1 : 0;
 }
 #endif // main
\ No newline at end of file
@@ -1,125 +1,886 @@
+#include "./reduce.h"
 #include "./priorityQueue.h"
-#include "./hashMap.h"
+#include "./arena.h"
+#include "./histogram.h"
 #include "./octTree.h"
 #include "./colour3.h"
 #include "./vector3.h"
 #include "./images.h"
+#include "./gif.h"
 
 #include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <limits.h>
 
-typedef struct Node {
-    Colour3 color;
-    Colour3* replacement;
-    int frequency;
-    int recursiveFrequency;
-    #ifdef _DEBUG
-    OctTree* tree;
-    #endif // _DEBUG
-} Node;
+// A buffer which is shared between the remap and the writers, it goes back to its pool once every reference is released
+typedef struct PoolBuffer {
+    struct BufferPool* pool;
+    struct PoolBuffer* next;
+    int references;
+    size_t size;
+    unsigned char* data;
+} PoolBuffer;
 
+// Buffers are recycled rather than freed, and at most limit buffers are ever allocated so acquiring waits for a release
+typedef struct BufferPool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    PoolBuffer* free;
+    int remaining;
+} BufferPool;
+
+// The images within a job are views of pool buffers, the job owns one reference to each buffer and both of its paths
 typedef struct ThreadData {
     Image pallet;
     Image output;
-    char outputPath[256];
-    char palletPath[256];
+    IndexedImage indexed;
+    PoolBuffer* palletBuffer;
+    PoolBuffer* outputBuffer;
+    ImageFormat format;
+    char* outputPath;
+    char* palletPath;
 } ThreadData;
 
-void scanImage(Image image, HashMap* colours, OctTree* tree) {
-    for (unsigned i = 0; i < image.height*image.width; i++) {
-        Colour3 color = colour3_fromBuffer(image.buffer, i*4);
-        int key = colour3_hash(color);
+typedef struct ScanData {
+    Image image;
+    unsigned start;
+    unsigned end;
+    Histogram* histogram;
+} ScanData;
+
+typedef struct RemapData {
+    const Refinement* refinement;
+    Image image;
+    Image output;
+    IndexedImage indexed;
+    unsigned start;
+    unsigned end;
+} RemapData;
+
+// A fixed number of writer threads which save the images from a bounded queue of jobs
+// A job only leaves the pool once it has been written, so at most capacity jobs exist at once and submitting waits for space
+typedef struct WriterPool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    ThreadData* jobs;
+    int capacity;
+    int head;
+    int queued;
+    int outstanding;
+    int closing;
+    int failed;
+    pthread_t* threads;
+    int threadCount;
+} WriterPool;
+
+long getCoreCount() {
+    long coreCount = sysconf(_SC_NPROCESSORS_ONLN);
+    return coreCount < 1 ? 1 : coreCount;
+}
+
+long getBandCount(Image image) {
+    long bandCount = getCoreCount();
+    if (bandCount > image.height) bandCount = image.height ? image.height : 1;
+    return bandCount;
+}
+
+void* scanPixels(void* args) {
+    ScanData* data = (ScanData*)args;
+    countPixels(data->histogram, data->image, data->start, data->end);
+    return NULL;
+}
+
+size_t scanImage(Image image, OctTree* tree, Arena* arena) {
+    // Split the image into row bands, one for each core, the first band is scanned on this thread
+    long threadCount = getBandCount(image);
+    ScanData* scanData = malloc(sizeof(ScanData)*threadCount);
+    pthread_t* threads = malloc(sizeof(pthread_t)*threadCount);
+
+    // Each band counts into its own histogram so no locking is needed, the first band uses the final histogram
+    Histogram* histogram = histogram_new();
+    for (long i = 0; i < threadCount; i++) {
+        scanData[i].image = image;
+        scanData[i].start = (unsigned)(image.height*i/threadCount);
+        scanData[i].end = (unsigned)(image.height*(i+1)/threadCount);
+        scanData[i].histogram = i ? histogram_new() : histogram;
+        if (i) pthread_create(threads+i, NULL, scanPixels, (void*)(scanData+i));
+    }
+    scanPixels(scanData);
+
+    // Merge the partial counts, addition is order independent so the result matches the single threaded scan
+    for (long i = 1; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+        histogram_merge(histogram, scanData[i].histogram);
+        histogram_destroy(scanData[i].histogram);
+    }
+    free(scanData);
+    free(threads);
+
+    // Compact the histogram into the unique colours and build the tree from them
+    size_t coloursLength = insertColours(histogram, tree, arena);
+    histogram_destroy(histogram);
+    return coloursLength;
+}
+
+void* remapBand(void* args) {
+    RemapData* data = (RemapData*)args;
+    if (data->indexed.buffer) remapIndexes(data->refinement, data->image, data->indexed, data->start, data->end);
+    else remapPixels(data->refinement, data->image, data->output, data->start, data->end);
+    return NULL;
+}
+
+// Only one of output and indexed should have a buffer, that is the one which is written to
+void remapImage(const Refinement* refinement, Image image, Image output, IndexedImage indexed) {
+    // Split the image into row bands, one for each core, the first band is remapped on this thread
+    long threadCount = getBandCount(image);
+    RemapData* remapData = malloc(sizeof(RemapData)*threadCount);
+    pthread_t* threads = malloc(sizeof(pthread_t)*threadCount);
+
+    // Every band writes to its own rows of the output and only reads the refinement, so the output matches the single threaded remap
+    for (long i = 0; i < threadCount; i++) {
+        remapData[i] = (RemapData){refinement, image, output, indexed, 0, 0};
+        remapData[i].start = (unsigned)(image.height*i/threadCount);
+        remapData[i].end = (unsigned)(image.height*(i+1)/threadCount);
+        if (i) pthread_create(threads+i, NULL, remapBand, (void*)(remapData+i));
+    }
+    remapBand(remapData);
+
+    for (long i = 1; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(remapData);
+    free(threads);
+}
+
+// Create an empty pool which will allocate at most limit buffers
+BufferPool* bufferPool_new(int limit) {
+    BufferPool* pool = malloc(sizeof(BufferPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->free = NULL;
+    pool->remaining = limit;
+    return pool;
+}
+
+// Take a buffer of at least size bytes with a single reference, its contents are left over from its last use
+// A recycled buffer is only reallocated when it is too small, so after the first few acquires no memory is allocated
+PoolBuffer* bufferPool_acquire(BufferPool* pool, size_t size) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->free && !pool->remaining) pthread_cond_wait(&pool->available, &pool->lock);
+    PoolBuffer* buffer = pool->free;
+    if (buffer) {
+        pool->free = buffer->next;
+    } else {
+        pool->remaining--;
+        buffer = calloc(1, sizeof(PoolBuffer));
+        buffer->pool = pool;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (size > buffer->size) {
+        buffer->data = realloc(buffer->data, size);
+        buffer->size = size;
+    }
+    buffer->references = 1;
+    buffer->next = NULL;
+    return buffer;
+}
+
+// Add a reference to a buffer so it can be handed to another owner without copying it
+void bufferPool_retain(PoolBuffer* buffer) {
+    pthread_mutex_lock(&buffer->pool->lock);
+    buffer->references++;
+    pthread_mutex_unlock(&buffer->pool->lock);
+}
+
+// Release a reference to a buffer, the last release returns it to the pool
+void bufferPool_release(PoolBuffer* buffer) {
+    BufferPool* pool = buffer->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (--buffer->references == 0) {
+        buffer->next = pool->free;
+        pool->free = buffer;
+        pthread_cond_signal(&pool->available);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Destroy a pool and the buffers it holds, every buffer must have been released
+void bufferPool_destroy(BufferPool* pool) {
+    while (pool->free) {
+        PoolBuffer* next = pool->free->next;
+        free(pool->free->data);
+        free(pool->free);
+        pool->free = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->available);
+    free(pool);
+}
+
+// Save the output and pallet of a job, returns the number of them which could not be written
+int saveImages(ThreadData* data) {
+    int failed = 0;
+    int written = data->indexed.buffer
+        ? writeIndexedImage(data->indexed, data->outputPath, data->format)
+        : writeImage(data->output, data->outputPath, data->format);
+    if (written) printf("Wrote %s\n", data->outputPath);
+    else failed++;
+    bufferPool_release(data->outputBuffer);
 
-        Node* node = hashMap_getValue(colours, key);
-        if (node) {
-            node->frequency++;
+    if (writeImage(data->pallet, data->palletPath, data->format)) printf("Wrote %s\n", data->palletPath);
+    else failed++;
+    bufferPool_release(data->palletBuffer);
+
+    free(data->outputPath);
+    free(data->palletPath);
+
+    return failed;
+}
+
+// Take jobs from the queue until it is empty and the pool is closing, the lock is not held while a job is saved
+void* writerPool_work(void* args) {
+    WriterPool* pool = (WriterPool*)args;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->queued && !pool->closing) pthread_cond_wait(&pool->ready, &pool->lock);
+        if (!pool->queued) break;
+
+        ThreadData job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        int failed = saveImages(&job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->failed += failed;
+        pool->outstanding--;
+        pthread_cond_signal(&pool->space);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start a pool of writer threads, one job can be outstanding for each thread
+WriterPool* writerPool_new(int threadCount) {
+    WriterPool* pool = malloc(sizeof(WriterPool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->space, NULL);
+    pool->capacity = threadCount;
+    pool->jobs = malloc(sizeof(ThreadData)*pool->capacity);
+    pool->head = pool->queued = pool->outstanding = pool->closing = pool->failed = 0;
+    pool->threadCount = threadCount;
+    pool->threads = malloc(sizeof(pthread_t)*threadCount);
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(pool->threads+i, NULL, writerPool_work, (void*)pool);
+    }
+    return pool;
+}
+
+// Add a job to the queue, this blocks until an earlier job has finished if the pool is full
+void writerPool_submit(WriterPool* pool, const ThreadData* job) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding == pool->capacity) pthread_cond_wait(&pool->space, &pool->lock);
+    pool->jobs[(pool->head + pool->queued) % pool->capacity] = *job;
+    pool->queued++; pool->outstanding++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for every queued job to be written, then stop the threads and free the pool, returns the number of images which could not be written
+int writerPool_destroy(WriterPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->space);
+    int failed = pool->failed;
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool);
+    return failed;
+}
+
+#ifndef main
+int desiredColourSortCmp(const void* a, const void* b) {
+    return *(int*)a - *(int*)b;
+}
+
+int pathSortCmp(const void* a, const void* b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// The images of a batch and the reductions made to each of them, workers take the next image until none are left
+// Images which can not be read or written are counted as skipped, outputs of a shared set which can not be written are counted as failed
+typedef struct Batch {
+    pthread_mutex_t lock;
+    char** paths;
+    int pathsLength;
+    int next;
+    const int* desiredColours;
+    int desiredColoursLength;
+    int maxDesired;
+    ImageFormat format;
+    int skipped;
+    int failed;
+    unsigned long long pixels;
+} Batch;
+
+// Everything a worker needs to reduce one image, it is reset between images rather than freed so only the decoded image is allocated each time
+typedef struct BatchWorker {
+    Batch* batch;
+    Histogram* histogram;
+    Arena* arena;
+    OctTree tree;
+    Refinement* refinement;
+    unsigned* selected;
+    int* owners;
+    Image pallet;
+    Image output;
+    IndexedImage indexed;
+    char* outputPath;
+    size_t outputPathSize;
+} BatchWorker;
+
+// Copy an input path into a reused output path buffer, returns where the extension starts so a suffix can be written over it
+// The buffer is only grown when a longer path is seen, and has room for the longest suffix
+char* setOutputPath(char** outputPath, size_t* outputPathSize, const char* path) {
+    size_t size = strlen(path)+32;
+    if (size > *outputPathSize) {
+        *outputPath = realloc(*outputPath, size);
+        *outputPathSize = size;
+    }
+    strcpy(*outputPath, path);
+    char* outputFileExtension = strrchr(*outputPath, '.');
+    if (!outputFileExtension || strchr(outputFileExtension, '/')) outputFileExtension = *outputPath + strlen(*outputPath);
+    return outputFileExtension;
+}
+
+// Test whether a file name is one written by a reduction, which is <stem>_reduced_<N>.<ext> or <stem>_pallet_<N>.<ext> for an output format
+int batch_isOutputName(const char* name) {
+    const char* extension = strrchr(name, '.');
+    if (!extension || parseImageFormat(extension+1) < 0) return 0;
+    const char* digits = extension;
+    while (digits > name && isdigit((unsigned char)digits[-1])) digits--;
+    if (digits == extension) return 0;
+    size_t stemLength = (size_t)(digits - name);
+    return (stemLength > 9 && strncmp(digits-9, "_reduced_", 9) == 0) || (stemLength > 8 && strncmp(digits-8, "_pallet_", 8) == 0);
+}
+
+// List the images of a batch, which is either every file within a directory or a file with one path on each line
+// Directory entries are sorted so the order does not depend on the file system, hidden files and earlier outputs are skipped
+int batch_listPaths(const char* inputPath, char*** paths) {
+    int pathsLength = 0, pathsSize = 64;
+    *paths = malloc(sizeof(char*)*pathsSize);
+
+    struct stat status;
+    if (stat(inputPath, &status) == 0 && S_ISDIR(status.st_mode)) {
+        DIR* directory = opendir(inputPath);
+        struct dirent* entry;
+        while (directory && (entry = readdir(directory))) {
+            if (entry->d_name[0] == '.' || batch_isOutputName(entry->d_name)) continue;
+            char* path = malloc(strlen(inputPath)+strlen(entry->d_name)+2);
+            sprintf(path, inputPath[strlen(inputPath)-1] == '/' ? "%s%s" : "%s/%s", inputPath, entry->d_name);
+            if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+                free(path);
+                continue;
+            }
+            if (pathsLength == pathsSize) *paths = realloc(*paths, sizeof(char*)*(pathsSize *= 2));
+            (*paths)[pathsLength++] = path;
+        }
+        if (directory) closedir(directory);
+        qsort(*paths, pathsLength, sizeof(char*), pathSortCmp);
+        return pathsLength;
+    }
+
+    FILE* list = fopen(inputPath, "r");
+    if (!list) return -1;
+    char line[4096];
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) continue;
+        if (pathsLength == pathsSize) *paths = realloc(*paths, sizeof(char*)*(pathsSize *= 2));
+        (*paths)[pathsLength++] = strcpy(malloc(strlen(line)+1), line);
+    }
+    fclose(list);
+    return pathsLength;
+}
+
+// Reduce one image on the calling thread, every output is written before this returns
+void batchWorker_reduce(BatchWorker* worker, const char* path) {
+    Batch* batch = worker->batch;
+    Image image = readImage(path);
+    if (!image.bufferSize) {
+        fprintf(stderr, "error: %s can not be read or decoded, must be one of: png, jpeg, jpg, ppm, pam\n", path);
+        pthread_mutex_lock(&batch->lock);
+        batch->skipped++;
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+
+    // Count every pixel and build the tree, the histogram is cleared straight away so it is ready for the next image
+    countPixels(worker->histogram, image, 0, image.height);
+    size_t coloursLength = insertColours(worker->histogram, &worker->tree, worker->arena);
+    histogram_clear(worker->histogram);
+    printf("Read %s %ix%i pixels containing %li unique colours\n", path, image.height, image.width, coloursLength);
+
+    // Select the nodes to be used, the refinement keeps its index table from the previous image
+    int selectedLength = 0;
+    selectNodes(&worker->tree, worker->selected, worker->owners, &selectedLength, batch->maxDesired);
+    if (worker->refinement) refinement_reset(worker->refinement, &worker->tree, worker->selected, worker->owners, selectedLength);
+    else worker->refinement = refinement_new(&worker->tree, worker->selected, worker->owners, selectedLength);
+
+    char* outputFileExtension = setOutputPath(&worker->outputPath, &worker->outputPathSize, path);
+
+    // The desired colours are already sorted, so the pallet is refined from one size to the next as in a single image run
+    // An output which can not be written fails the image, its remaining outputs are not made but the rest of the batch is still reduced
+    int written = 1;
+    resizeIndexedImage(&worker->indexed, image.height, image.width);
+    for (int desiredColourIndex = 0; written && desiredColourIndex < batch->desiredColoursLength; desiredColourIndex++) {
+        int desired = batch->desiredColours[desiredColourIndex];
+        if (desired > selectedLength) desired = selectedLength; // Only trigged if desired is greater than the total number of colours in the image
+        refinement_refine(worker->refinement, desired);
+        drawPallet(worker->refinement, &worker->pallet, desired);
+
+        int isIndexed = desired <= images_MAX_PALLET;
+        ImageFormat outputFormat = isIndexed ? batch->format : fullColourFormat(batch->format);
+        sprintf(outputFileExtension, "_reduced_%i.%s", batch->desiredColours[desiredColourIndex], imageFormatExtension(outputFormat));
+        if (isIndexed) {
+            copyPallet(worker->refinement, &worker->indexed);
+            remapIndexes(worker->refinement, image, worker->indexed, 0, image.height);
+            written = writeIndexedImage(worker->indexed, worker->outputPath, batch->format);
         } else {
-            node = malloc(sizeof(Node));
-            node->color = color; node->replacement = NULL;
-            node->frequency = 1; node->recursiveFrequency = 0;
-            Vector3 vec3 = colour3_toVector3(color);
-            hashMap_setValue(colours, key, node);
-            octTree_setValue(tree, &vec3, node);
-            #ifdef _DEBUG
-            node->tree = octTree_getSubTree(tree, &vec3);
-            #endif
+            resizeImage(&worker->output, image.height, image.width);
+            remapPixels(worker->refinement, image, worker->output, 0, image.height);
+            written = writeImage(worker->output, worker->outputPath, batch->format);
         }
-    }   
+        if (!written) break;
+        printf("Wrote %s\n", worker->outputPath);
+
+        sprintf(outputFileExtension, "_pallet_%i.%s", batch->desiredColours[desiredColourIndex], imageFormatExtension(fullColourFormat(batch->format)));
+        written = writeImage(worker->pallet, worker->outputPath, batch->format);
+        if (written) printf("Wrote %s\n", worker->outputPath);
+    }
+    if (!written) {
+        pthread_mutex_lock(&batch->lock);
+        batch->skipped++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    // The tree is released in one go, its blocks are kept for the next image
+    destroyImage(&image);
+    arena_reset(worker->arena);
 }
 
-int recursiveFrequency(OctTree* tree) {
-    if (!tree->value) return 0;
-    Node* node = tree->value;
-    if (node->recursiveFrequency) return node->recursiveFrequency;
+// Take the next image of a batch, returns -1 once every image has been taken
+int batch_take(Batch* batch) {
+    pthread_mutex_lock(&batch->lock);
+    int next = batch->next < batch->pathsLength ? batch->next++ : -1;
+    pthread_mutex_unlock(&batch->lock);
+    return next;
+}
+
+// Take images from the batch until there are none left
+void* batchWorker_work(void* args) {
+    BatchWorker* worker = (BatchWorker*)args;
+    int next;
+    while ((next = batch_take(worker->batch)) >= 0) {
+        batchWorker_reduce(worker, worker->batch->paths[next]);
+    }
+    return NULL;
+}
+
+// Reduce every image of a batch on a fixed number of workers, each worker handles a whole image at a time so no image is split between threads
+int batchReduce(const char* inputPath, ImageFormat format, int desiredColours[], int desiredColoursLength, int maxDesired, int workerCount) {
+    Batch batch = {0};
+    batch.pathsLength = batch_listPaths(inputPath, &batch.paths);
+    if (batch.pathsLength < 0) {
+        fprintf(stderr, "error invalid argument 1: a batch must be a directory or a file listing one image on each line\n");
+        free(batch.paths);
+        return 1;
+    }
+    qsort(desiredColours, desiredColoursLength, sizeof(int), desiredColourSortCmp);
+    batch.desiredColours = desiredColours; batch.desiredColoursLength = desiredColoursLength;
+    batch.maxDesired = maxDesired; batch.format = format;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    // There is no point starting more workers than there are images, the first worker runs on this thread
+    if (workerCount > batch.pathsLength) workerCount = batch.pathsLength ? batch.pathsLength : 1;
+    BatchWorker* workers = malloc(sizeof(BatchWorker)*workerCount);
+    pthread_t* threads = malloc(sizeof(pthread_t)*workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        BatchWorker* worker = workers+i;
+        *worker = (BatchWorker){0};
+        worker->batch = &batch;
+        worker->histogram = histogram_new();
+        worker->arena = arena_new();
+        worker->selected = malloc(sizeof(unsigned)*maxDesired);
+        worker->owners = malloc(sizeof(int)*maxDesired);
+        worker->pallet = newImage(0, 0);
+        worker->output = newImage(0, 0);
+        worker->indexed = newIndexedImage(0, 0);
+        if (i) pthread_create(threads+i, NULL, batchWorker_work, (void*)worker);
+    }
+    batchWorker_work(workers);
 
-    int frequency = 0, valuesLength = 0, valuesSize = 256;
-    Node** values = malloc(sizeof(Node*)*256);
-    values = (Node**) octTree_values(tree, (void**)values, &valuesLength, &valuesSize);
-    for (int i = 0; i < valuesLength; i++) {
-        frequency += values[i]->frequency;
+    // Wait for every image to be written, then release what each worker kept
+    for (int i = 0; i < workerCount; i++) {
+        BatchWorker* worker = workers+i;
+        if (i) pthread_join(threads[i], NULL);
+        histogram_destroy(worker->histogram);
+        arena_destroy(worker->arena);
+        if (worker->refinement) refinement_destroy(worker->refinement);
+        free(worker->selected);
+        free(worker->owners);
+        destroyImage(&worker->pallet);
+        destroyImage(&worker->output);
+        destroyIndexedImage(&worker->indexed);
+        free(worker->outputPath);
     }
+    printf("Reduced %i of %i images\n", batch.pathsLength - batch.skipped, batch.pathsLength);
 
-    node->recursiveFrequency = frequency;
-    return frequency;
+    for (int i = 0; i < batch.pathsLength; i++) free(batch.paths[i]);
+    free(batch.paths);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.skipped ? 1 : 0;
 }
 
-void selectNodes(OctTree* tree, OctTree* selected[], int* selectedLength, int selectedSize) {
-    PriorityQueue* queue = priorityQueue_preAlloc(selectedSize*8);
-    priorityQueue_push(queue, recursiveFrequency(tree), tree);
-
-    OctTree* children[8];
-    int childrenLength = 0;
-    while (*selectedLength < selectedSize && priorityQueue_hasNext(queue)) {
-        OctTree* nextTree = priorityQueue_pop(queue);
-        childrenLength = octTree_getChildren(nextTree, children);
-        for (int i = 0; i < childrenLength; i++) {
-            priorityQueue_push(queue, recursiveFrequency(children[i]), children[i]);
+// A worker which scans or remaps whole images of a set reduced to one shared pallet
+// Only the size of each image is kept between passes, an image is decoded again each time it is remapped so the set is never held in memory at once
+// When the set is written as an animated gif each image is encoded into its frame rather than written, so the frames can be written in order
+typedef struct SharedWorker {
+    Batch* batch;
+    unsigned* widths;
+    unsigned* heights;
+    Histogram* histogram;
+    const Refinement* refinement;
+    int desiredColourIndex;
+    IndexedImage indexed;
+    Image output;
+    char* outputPath;
+    size_t outputPathSize;
+    GifEncoder* gif;
+    unsigned char** frames;
+    size_t* frameSizes;
+} SharedWorker;
+
+// Decode images and count them into this worker's histogram, then release them, an image which can not be decoded keeps a width of 0 and is skipped later
+void* sharedWorker_scan(void* args) {
+    SharedWorker* worker = (SharedWorker*)args;
+    Batch* batch = worker->batch;
+    int next;
+    while ((next = batch_take(batch)) >= 0) {
+        Image image = readImage(batch->paths[next]);
+        if (!image.bufferSize) {
+            fprintf(stderr, "error: %s can not be read or decoded, must be one of: png, jpeg, jpg, ppm, pam\n", batch->paths[next]);
+            pthread_mutex_lock(&batch->lock);
+            batch->skipped++;
+            pthread_mutex_unlock(&batch->lock);
+            continue;
         }
-        selected[(*selectedLength)++] = nextTree;
+        countPixels(worker->histogram, image, 0, image.height);
+        pthread_mutex_lock(&batch->lock);
+        batch->pixels += (unsigned long long)image.width*image.height;
+        pthread_mutex_unlock(&batch->lock);
+        printf("Read %s %ix%i pixels\n", batch->paths[next], image.height, image.width);
+        worker->widths[next] = image.width;
+        worker->heights[next] = image.height;
+        destroyImage(&image);
     }
+    return NULL;
 }
 
-void* saveImages(void* args) {
-    ThreadData* data = (ThreadData*)args;
+// Remap images against the current length of the shared pallet and write them, each worker has its own output buffers
+void* sharedWorker_remap(void* args) {
+    SharedWorker* worker = (SharedWorker*)args;
+    Batch* batch = worker->batch;
+    const Refinement* refinement = worker->refinement;
+    int requested = batch->desiredColours[worker->desiredColourIndex];
+    int isIndexed = refinement->length <= images_MAX_PALLET;
+    ImageFormat outputFormat = isIndexed ? batch->format : fullColourFormat(batch->format);
+    if (isIndexed) copyPallet(refinement, &worker->indexed);
 
-    writeImage(data->output, data->outputPath);
-    printf("Wrote %s\n", data->outputPath);
-    destroyImage(&data->output);
+    int next;
+    while ((next = batch_take(batch)) >= 0) {
+        if (!worker->widths[next]) continue;
 
-    writeImage(data->pallet, data->palletPath);
-    printf("Wrote %s\n", data->palletPath);
-    destroyImage(&data->pallet);
+        // The image must decode to the same size as when it was scanned, otherwise it would not fit the animation
+        Image image = readImage(batch->paths[next]);
+        if (!image.bufferSize || image.width != worker->widths[next] || image.height != worker->heights[next]) {
+            fprintf(stderr, "error: %s has changed since it was scanned\n", batch->paths[next]);
+            pthread_mutex_lock(&batch->lock);
+            batch->failed++;
+            pthread_mutex_unlock(&batch->lock);
+            destroyImage(&image);
+            continue;
+        }
+
+        // The encoder hands its output to the frame, so the next frame starts with an empty buffer and nothing is copied
+        if (isIndexed && worker->frames) {
+            resizeIndexedImage(&worker->indexed, image.height, image.width);
+            remapIndexes(refinement, image, worker->indexed, 0, image.height);
+            gif_beginFrame(worker->gif, image.width, image.height, refinement->length, 1);
+            gif_encode(worker->gif, worker->indexed.buffer, (size_t)image.width*image.height);
+            gif_endFrame(worker->gif);
+            worker->frames[next] = worker->gif->output;
+            worker->frameSizes[next] = worker->gif->outputLength;
+            worker->gif->output = NULL;
+            worker->gif->outputLength = worker->gif->outputSize = 0;
+            destroyImage(&image);
+            continue;
+        }
 
+        char* outputFileExtension = setOutputPath(&worker->outputPath, &worker->outputPathSize, batch->paths[next]);
+        sprintf(outputFileExtension, "_reduced_%i.%s", requested, imageFormatExtension(outputFormat));
+        int written;
+        if (isIndexed) {
+            resizeIndexedImage(&worker->indexed, image.height, image.width);
+            remapIndexes(refinement, image, worker->indexed, 0, image.height);
+            written = writeIndexedImage(worker->indexed, worker->outputPath, batch->format);
+        } else {
+            resizeImage(&worker->output, image.height, image.width);
+            remapPixels(refinement, image, worker->output, 0, image.height);
+            written = writeImage(worker->output, worker->outputPath, batch->format);
+        }
+        if (written) {
+            printf("Wrote %s\n", worker->outputPath);
+        } else {
+            pthread_mutex_lock(&batch->lock);
+            batch->failed++;
+            pthread_mutex_unlock(&batch->lock);
+        }
+        destroyImage(&image);
+    }
     return NULL;
 }
 
-#ifndef main
-#define PALLET_SCALE 4
+// Run every worker over the set from its first image, the first worker runs on this thread
+void sharedWorkers_run(SharedWorker* workers, int workerCount, void* (*work)(void*)) {
+    pthread_t* threads = malloc(sizeof(pthread_t)*workerCount);
+    workers->batch->next = 0;
+    for (int i = 1; i < workerCount; i++) pthread_create(threads+i, NULL, work, (void*)(workers+i));
+    work(workers);
+    for (int i = 1; i < workerCount; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
 
-int desiredColourSortCmp(const void* a, const void* b) {
-    return *(int*)a - *(int*)b;
+// Reduce a set of images to one pallet, such as the frames of an animation or the sheets of a sprite set, so every output shares the same colours
+// All images are counted into one tree which is built and selected from once, then each image is remapped against the same refinement
+// The pallet image is written once for the whole set, named after the directory or list of images
+// As a gif the whole set is written as one animation named after the set, with the images as its frames in the order they were listed
+int sharedReduce(const char* inputPath, ImageFormat format, int desiredColours[], int desiredColoursLength, int maxDesired, int workerCount) {
+    Batch batch = {0};
+    batch.pathsLength = batch_listPaths(inputPath, &batch.paths);
+    if (batch.pathsLength < 0) {
+        fprintf(stderr, "error invalid argument 1: a set of images must be a directory or a file listing one image on each line\n");
+        free(batch.paths);
+        return 1;
+    }
+    qsort(desiredColours, desiredColoursLength, sizeof(int), desiredColourSortCmp);
+    batch.desiredColours = desiredColours; batch.desiredColoursLength = desiredColoursLength;
+    batch.maxDesired = maxDesired; batch.format = format;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (workerCount > batch.pathsLength) workerCount = batch.pathsLength ? batch.pathsLength : 1;
+    unsigned* widths = calloc(batch.pathsLength ? batch.pathsLength : 1, sizeof(unsigned));
+    unsigned* heights = calloc(batch.pathsLength ? batch.pathsLength : 1, sizeof(unsigned));
+    unsigned char** frames = format == IMAGE_GIF ? calloc(batch.pathsLength ? batch.pathsLength : 1, sizeof(unsigned char*)) : NULL;
+    size_t* frameSizes = format == IMAGE_GIF ? calloc(batch.pathsLength ? batch.pathsLength : 1, sizeof(size_t)) : NULL;
+    SharedWorker* workers = calloc(workerCount, sizeof(SharedWorker));
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].batch = &batch;
+        workers[i].widths = widths;
+        workers[i].heights = heights;
+        workers[i].histogram = histogram_new();
+        workers[i].indexed = newIndexedImage(0, 0);
+        workers[i].output = newImage(0, 0);
+        workers[i].frames = frames;
+        workers[i].frameSizes = frameSizes;
+        if (frames) workers[i].gif = gif_newEncoder();
+    }
+
+    // Scan every image in parallel, then merge the counts so the tree is built once for the whole set
+    sharedWorkers_run(workers, workerCount, sharedWorker_scan);
+    for (int i = 1; i < workerCount; i++) {
+        histogram_merge(workers->histogram, workers[i].histogram);
+        histogram_destroy(workers[i].histogram);
+    }
+
+    // Pixel counts are held as unsigned and ranked with int priorities when selecting, so a set with more pixels than that would overflow them
+    // The counts of such a set are cleared, which leaves the tree empty so nothing is written, as for a set where no image could be read
+    int tooLarge = batch.pixels > INT_MAX;
+    if (tooLarge) {
+        fprintf(stderr, "error invalid argument 1: a shared pallet can reduce at most %i pixels, got %llu\n", INT_MAX, batch.pixels);
+        histogram_clear(workers->histogram);
+    }
+    OctTree tree;
+    Arena* arena = arena_new();
+    size_t coloursLength = insertColours(workers->histogram, &tree, arena);
+    histogram_destroy(workers->histogram);
+    printf("Read %i images containing %li unique colours\n", batch.pathsLength - batch.skipped, coloursLength);
+
+    // Select the nodes once, every image uses the same selections
+    int selectedLength = 0;
+    unsigned* selected = malloc(sizeof(unsigned)*maxDesired);
+    int* owners = malloc(sizeof(int)*maxDesired);
+    selectNodes(&tree, selected, owners, &selectedLength, maxDesired);
+    Refinement* refinement = refinement_new(&tree, selected, owners, selectedLength);
+    for (int i = 0; i < workerCount; i++) workers[i].refinement = refinement;
+
+    // The pallet is named after the set, a trailing slash of a directory is ignored and a directory has no extension to replace
+    // A directory given as . or .. is resolved first, so the outputs are named after the directory it refers to
+    char* palletPath = NULL;
+    size_t palletPathSize = 0;
+    char* setPath = strcpy(malloc(strlen(inputPath)+1), inputPath);
+    for (size_t length = strlen(setPath); length > 1 && setPath[length-1] == '/'; length--) setPath[length-1] = '\0';
+    const char* setName = strrchr(setPath, '/');
+    setName = setName ? setName+1 : setPath;
+    if (!strcmp(setName, ".") || !strcmp(setName, "..")) {
+        char* resolved = realpath(setPath, NULL);
+        if (resolved) {
+            free(setPath);
+            setPath = resolved;
+        }
+    }
+    struct stat setStatus;
+    char* palletFileExtension = setOutputPath(&palletPath, &palletPathSize, setPath);
+    if (stat(setPath, &setStatus) == 0 && S_ISDIR(setStatus.st_mode)) palletFileExtension = palletPath + strlen(palletPath);
+    Image pallet = newImage(0, 0);
+
+    // A set where no image could be read has no colours to share, so no outputs are written for it
+    int readLength = tooLarge ? 0 : batch.pathsLength - batch.skipped;
+    for (int desiredColourIndex = 0; readLength && desiredColourIndex < desiredColoursLength; desiredColourIndex++) {
+        int desired = desiredColours[desiredColourIndex];
+        if (desired > selectedLength) desired = selectedLength; // Only trigged if desired is greater than the total number of colours in the set
+
+        // Grow the shared pallet, then remap every image against it
+        refinement_refine(refinement, desired);
+        for (int i = 0; i < workerCount; i++) workers[i].desiredColourIndex = desiredColourIndex;
+        sharedWorkers_run(workers, workerCount, sharedWorker_remap);
+
+        // The frames are written in order once every image has been encoded, the animation is as large as its largest frame
+        if (frames && desired <= images_MAX_PALLET) {
+            IndexedImage sharedPallet = {0};
+            copyPallet(refinement, &sharedPallet);
+            for (int i = 0; i < batch.pathsLength; i++) {
+                if (widths[i] > sharedPallet.width) sharedPallet.width = widths[i];
+                if (heights[i] > sharedPallet.height) sharedPallet.height = heights[i];
+            }
+
+            sprintf(palletFileExtension, "_reduced_%i.gif", desiredColours[desiredColourIndex]);
+            FILE* file = fopen(palletPath, "wb");
+            if (file) gif_writeHeader(file, sharedPallet.width, sharedPallet.height, &sharedPallet, 1);
+            for (int i = 0; i < batch.pathsLength; i++) {
+                if (file && frames[i]) fwrite(frames[i], 1, frameSizes[i], file);
+                free(frames[i]);
+                frames[i] = NULL;
+            }
+            if (file) {
+                gif_writeTrailer(file);
+                fclose(file);
+                printf("Wrote %s\n", palletPath);
+            } else {
+                fprintf(stderr, "error: could not open %s for writing\n", palletPath);
+                batch.failed++;
+            }
+        }
+
+        drawPallet(refinement, &pallet, desired);
+        sprintf(palletFileExtension, "_pallet_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(fullColourFormat(format)));
+        if (writeImage(pallet, palletPath, format)) printf("Wrote %s\n", palletPath);
+        else batch.failed++;
+    }
+    printf("Reduced %i of %i images\n", readLength, batch.pathsLength);
+    if (batch.failed) fprintf(stderr, "error: %i outputs could not be written\n", batch.failed);
+
+    // Release the worker buffers, then the tree in one go
+    for (int i = 0; i < batch.pathsLength; i++) free(batch.paths[i]);
+    for (int i = 0; i < workerCount; i++) {
+        destroyIndexedImage(&workers[i].indexed);
+        destroyImage(&workers[i].output);
+        free(workers[i].outputPath);
+        if (workers[i].gif) gif_destroyEncoder(workers[i].gif);
+    }
+    free(frames);
+    free(frameSizes);
+    destroyImage(&pallet);
+    refinement_destroy(refinement);
+    arena_destroy(arena);
+    free(widths);
+    free(heights);
+    free(workers);
+    free(selected);
+    free(owners);
+    free(setPath);
+    free(palletPath);
+    free(batch.paths);
+    pthread_mutex_destroy(&batch.lock);
+    return tooLarge || batch.skipped || batch.failed ? 1 : 0;
 }
 
 int main(int argc, char** argv) {
-    // Check that exactly two arguments were given
-    if (argc != 3) {
-        printf("error: wrong number of arguments, 2 expect got %i\n", argc);
+    // The number of writer threads can be given with -t, by default there is one for each core, and -f selects the output format
+    // With -b the input is a directory or a list of images, which are reduced one whole image per thread with -t threads
+    // With -g the input is also a set of images, but they are all reduced to one shared pallet
+    int writerCount = (int)getCoreCount();
+    ImageFormat format = IMAGE_PNG;
+    int batch = 0, shared = 0;
+    int option;
+    while ((option = getopt(argc, argv, "t:f:bg")) != -1) {
+        if (option == 't' && atoi(optarg) > 0) {
+            writerCount = atoi(optarg);
+        } else if (option == 'f' && parseImageFormat(optarg) >= 0) {
+            format = (ImageFormat)parseImageFormat(optarg);
+        } else if (option == 'b' && !shared) {
+            batch = 1;
+        } else if (option == 'g' && !batch) {
+            shared = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-t threads] [-f png|pam|raw|gif] [-b | -g] input colours\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Check that exactly two arguments were given after the options
+    if (argc - optind != 2) {
+        fprintf(stderr, "error: wrong number of arguments, 2 expect got %i\n", argc - optind);
         return 1;
     }
+    char* inputPath = argv[optind];
+    char* desiredArgument = argv[optind+1];
 
+    // There is one desired colour count for each comma separated value
     int maxDesired = 0;
-    int desiredColours[16];
     int desiredColoursLength = 0;
+    int desiredColoursSize = 1;
+    for (char* c = desiredArgument; *c; c++) if (*c == ',') desiredColoursSize++;
+    int* desiredColours = malloc(sizeof(int)*desiredColoursSize);
+
     // Split the second argument into a list of ints
-    char* token = strtok(argv[2], ",");
-    while (token != NULL && desiredColoursLength < 16) {
+    char* token = strtok(desiredArgument, ",");
+    while (token != NULL) {
         int value = atoi(token);
         desiredColours[desiredColoursLength++] = value;
         if (value <= 0) {
-            printf("error invalid argument 2: must be integer greater than 0, got: '%s'\n", token);
+            fprintf(stderr, "error invalid argument 2: must be integer greater than 0, got: '%s'\n", token);
             return 1;
         } else if (value > maxDesired) {
             maxDesired = value; // New maximum value
@@ -127,17 +888,23 @@ int main(int argc, char** argv) {
         token = strtok(NULL, ",");
     }
 
-    // If token is not null then we ran out of room in the colours array
-    if (token) {
-        printf("error invalid argument 2: can only contain a maximum of 16 different reductions at once\n");
+    // Check that at least one value was given, this only happens when the argument is all commas
+    if (!desiredColoursLength) {
+        fprintf(stderr, "error invalid argument 2: must contain at least one integer\n");
         return 1;
     }
 
-    char* inputPath = argv[1];
+    if (batch || shared) {
+        int result = batch ? batchReduce(inputPath, format, desiredColours, desiredColoursLength, maxDesired, writerCount)
+            : sharedReduce(inputPath, format, desiredColours, desiredColoursLength, maxDesired, writerCount);
+        free(desiredColours);
+        return result;
+    }
+
     // Get the file type so we can read in the image correctly
     Image image = readImage(inputPath);
     if (!image.bufferSize) {
-        printf("error invalid argument 1: file type can not be decoded, must be one of: png, jpeg, jpg\n");
+        fprintf(stderr, "error invalid argument 1: file can not be read or decoded, must be one of: png, jpeg, jpg, ppm, pam\n");
         return 1;
     }
 
@@ -145,124 +912,122 @@ int main(int argc, char** argv) {
         All arguments have been validated beyond this section
     */
 
-    // Setup the threads and the thread data structs
-    ThreadData threadDataArray[16];
-    pthread_t threads[16];
- 
-    // Allocate space for the colour map and colour tree
-    HashMap* colours = hashMap_preAlloc(image.width*image.height/9);
-    OctTree tree = octTree_new(vector3_new(128, 128, 128), 128);
-
-    // Create a pallet with an internal buffer large enough for largest pallet
-    int maxPalletSize = PALLET_SCALE*(int)ceil(sqrt(maxDesired));
-    Image pallet = newImage(maxPalletSize, maxPalletSize);
-
-    // Copy the input path and image so it can be modified
-    char outputPath[256];
-    strcpy(outputPath, inputPath);
-    Image output = newImage(image.height, image.width);
+    // Start the writers, at most one image per writer is waiting to be saved at any time
+    WriterPool* writers = writerPool_new(writerCount);
+
+    // Every waiting job holds an output and a pallet buffer, this thread holds the two being filled
+    // Outputs and pallets are recycled through separate pools, so a small pallet buffer is never grown to the size of an output
+    BufferPool* outputBuffers = bufferPool_new(writerCount+1);
+    BufferPool* palletBuffers = bufferPool_new(writerCount+1);
+
+    // Allocate space for the colour tree, the arena holds all of its arrays
+    OctTree tree;
+    Arena* arena = arena_new();
+
+    // Copy the input path so it can be modified, images read from stdin are written to the working directory as "stdin"
+    const char* sourcePath = strcmp(inputPath, "-") == 0 ? "stdin" : inputPath;
+    char* outputPath = malloc(strlen(sourcePath)+32);
+    strcpy(outputPath, sourcePath);
     char* outputFileExtension = strrchr(outputPath, '.');
+    if (!outputFileExtension) outputFileExtension = outputPath + strlen(outputPath);
 
-    // Scan the image for all colours, inserting them into the map and tree
-    scanImage(image, colours, &tree);
-    printf("Read %ix%i pixels containing %li unique colours\n", image.height, image.width, colours->used);
+    // Pallets which fit within a png are written as one index per pixel, the pallet colours are stored alongside the view of its buffer
+    IndexedImage indexed = {0};
+    indexed.width = image.width; indexed.height = image.height;
+
+    // Scan the image for all colours, inserting them into the tree
+    size_t coloursLength = scanImage(image, &tree, arena);
+    printf("Read %ix%i pixels containing %li unique colours\n", image.height, image.width, coloursLength);
 
     // Select the nodes to be used, these nodes will later be used to generate the pallet
     int selectedLength = 0;
-    HashMap* excludeMap = hashMap_preAlloc(maxDesired);
-    OctTree** selected = malloc(sizeof(OctTree*)*maxDesired);
-    selectNodes(&tree, selected, &selectedLength, maxDesired);
+    unsigned* selected = malloc(sizeof(unsigned)*maxDesired);
+    int* owners = malloc(sizeof(int)*maxDesired);
+    selectNodes(&tree, selected, owners, &selectedLength, maxDesired);
 
-    // For optimisation reasons, allocate values outside the loops and sort the desired colours array
-    int previousDesired = 0;
-    int valuesLength = 0, valuesSize = 256;
-    Node** values = malloc(sizeof(Node*)*256);
+    // The pallet is refined from one desired size to the next, so sort the desired colours array
+    Refinement* refinement = refinement_new(&tree, selected, owners, selectedLength);
     qsort(desiredColours, desiredColoursLength, sizeof(int), desiredColourSortCmp);
+
+    // The previous job is kept so a repeated pallet length can share its buffers instead of being remapped
+    ThreadData job = {0};
+    int previousDesired = 0;
     for (int desiredColourIndex = 0; desiredColourIndex < desiredColoursLength; desiredColourIndex++) {
         int desired = desiredColours[desiredColourIndex];
         if (desired > selectedLength) desired = selectedLength; // Only trigged if desired is greater than the total number of colours in the image
 
-        // Create a hash map set of those selected nodes, using a set here greatly improves performance
-        for (int i = previousDesired; i < desired; i++) hashMap_setValue(excludeMap, octTree_pointerHash(selected[i]), HashMap_SetElementExists);
-
-        // Create an image for the pallet output
-        int palletSize = PALLET_SCALE*(int)ceil(sqrt(desired));
-        resizeImage(&pallet, palletSize, palletSize);
-
-        // Find the replacement colour for every node
-        for (int index = 0; index < desired; index++) {
-            OctTree* next = selected[index];
-            Node* node = next->value;
-
-            // Allocate the replacement colour
-            if (index >= previousDesired)
-                node->replacement = malloc(sizeof(Colour3));
-            Colour3* replacement = node->replacement;
-
-            // Initiate the count and sum from the root node
-            int count = node->frequency;
-            Vector3 sum = colour3_toVector3(node->color);
-            vector3_scale(&sum, count);
-
-            // For all descendants, set their replacement colour and add their frequencies
-            valuesLength = 0;
-            values = (Node**) octTree_valuesExcluding(next, excludeMap, (void**)values, &valuesLength, &valuesSize);
-            for (int i = 0; i < valuesLength; i++) {
-                Node* childNode = values[i];
-                childNode->replacement = replacement;
-                Vector3 vec3 = colour3_toVector3(childNode->color);
-                vector3_add_scaled(&sum, &vec3, childNode->frequency);
-                count += childNode->frequency;
+        if (job.outputBuffer && desired == previousDesired) {
+            // The images are identical to the previous job, so the writers share its buffers
+            bufferPool_retain(job.outputBuffer);
+            bufferPool_retain(job.palletBuffer);
+        } else {
+            if (job.outputBuffer) {
+                bufferPool_release(job.outputBuffer);
+                bufferPool_release(job.palletBuffer);
             }
 
-            // Calculate the weighted average
-            vector3_divide(&sum, count);
-            Colour3 colour = colour3_fromVector3(sum);
-            *replacement = colour;
-
-            // Add the colour to the pallet image
-            int row = PALLET_SCALE*((index*PALLET_SCALE) / pallet.width);
-            int column = (index*PALLET_SCALE) % pallet.width;
-            for (int ri = 0; ri < PALLET_SCALE; ri++) for (int ci = 0; ci < PALLET_SCALE; ci++) {
-                int idx = ((row+ri)*pallet.width+column+ci)*4;
-                colour3_toBufferWithAlpha(colour, pallet.buffer, idx, 255);
+            // Create an image for the pallet output, it is drawn into a pool buffer which is already large enough so it is never reallocated
+            int palletSize = reduce_PALLET_SCALE*(int)ceil(sqrt(desired));
+            job.palletBuffer = bufferPool_acquire(palletBuffers, (size_t)palletSize*palletSize*4);
+            Image pallet = {palletSize, palletSize, 4, (size_t)palletSize*4, job.palletBuffer->size, job.palletBuffer->data, NULL, 0};
+
+            // Grow the pallet, only the selections added since the previous size and the colours they own are updated
+            refinement_refine(refinement, desired);
+            drawPallet(refinement, &pallet, desired);
+            job.pallet = pallet;
+
+            // For each pixel in the input, remap straight into a pool buffer using every core, it is handed to the writer without a copy
+            size_t length = (size_t)image.height*image.width;
+            job.output = (Image){0};
+            job.indexed = (IndexedImage){0};
+            if (desired <= images_MAX_PALLET) {
+                job.outputBuffer = bufferPool_acquire(outputBuffers, length);
+                copyPallet(refinement, &indexed);
+                indexed.bufferSize = job.outputBuffer->size; indexed.buffer = job.outputBuffer->data;
+                remapImage(refinement, image, job.output, indexed);
+                job.indexed = indexed;
+            } else {
+                job.outputBuffer = bufferPool_acquire(outputBuffers, length*4);
+                Image output = {image.width, image.height, 4, (size_t)image.width*4, job.outputBuffer->size, job.outputBuffer->data, NULL, 0};
+                remapImage(refinement, image, output, job.indexed);
+                job.output = output;
             }
-        }
 
-        // For each pixel in the input, copy the replacement colour into the output
-        for (unsigned i = 0; i < image.height*image.width; i++) {
-            Colour3 color = colour3_fromBuffer(image.buffer, i*4);
-            Node* node = hashMap_getValue(colours, colour3_hash(color));
-            
-            Colour3 replacement = *node->replacement;
-            colour3_toBufferWithAlpha(replacement, output.buffer, i*4, 255);
+            // This thread keeps a reference until the next pallet length is known
+            bufferPool_retain(job.outputBuffer);
+            bufferPool_retain(job.palletBuffer);
+            previousDesired = desired;
         }
 
-        ThreadData* threadData = threadDataArray+desiredColourIndex;
-
         // Edit the file name to end in "_reduced" followed by the colour count
         // desiredColours[desiredColourIndex] is used in case selectedLength is smaller
-        sprintf(outputFileExtension, "_reduced_%i.png", desiredColours[desiredColourIndex]);
-        strcpy(threadData->outputPath, outputPath);
-        threadData->output = output;
-        threadData->output.buffer = malloc(output.bufferSize);
-        memcpy(threadData->output.buffer, output.buffer, output.bufferSize);
+        job.format = format;
+        ImageFormat outputFormat = job.indexed.buffer ? format : fullColourFormat(format);
+        sprintf(outputFileExtension, "_reduced_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(outputFormat));
+        job.outputPath = strcpy(malloc(strlen(outputPath)+1), outputPath);
         
         // Edit the file name to end in "_pallet" followed by the colour count
-        sprintf(outputFileExtension, "_pallet_%i.png", desiredColours[desiredColourIndex]);
-        strcpy(threadData->palletPath, outputPath);
-        threadData->pallet = pallet;
-        threadData->pallet.buffer = malloc(pallet.bufferSize);
-        memcpy(threadData->pallet.buffer, pallet.buffer, pallet.bufferSize);
+        sprintf(outputFileExtension, "_pallet_%i.%s", desiredColours[desiredColourIndex], imageFormatExtension(fullColourFormat(format)));
+        job.palletPath = strcpy(malloc(strlen(outputPath)+1), outputPath);
 
-        pthread_create(threads+desiredColourIndex, NULL, saveImages, (void*)threadData);
-        previousDesired = desiredColours[desiredColourIndex];
+        writerPool_submit(writers, &job);
     }
-
-    for (int i = 0; i < desiredColoursLength; i++) {
-        pthread_join(threads[i], NULL);
+    if (job.outputBuffer) {
+        bufferPool_release(job.outputBuffer);
+        bufferPool_release(job.palletBuffer);
     }
 
-    return 0;
+    // Wait for the remaining images to be saved
+    int failed = writerPool_destroy(writers);
+    bufferPool_destroy(outputBuffers);
+    bufferPool_destroy(palletBuffers);
+    free(desiredColours);
+    free(outputPath);
+
+    // Release the pallet, then the tree in one go
+    refinement_destroy(refinement);
+    arena_destroy(arena);
+
+    return failed ? 1 : 0;
 }
 #endif // main
\ No newline at end of file
@@ -1,126 +1,206 @@
 #include "./octTree.h"
-#include "./hashMap.h"
 #include <stdlib.h>
+#include <string.h>
 
-OctTree octTree_new(Vector3 pos, int size) {
-    OctTree tree;
-    tree.pos = pos;
-    tree.size = size;
-    tree.children = NULL;
-    tree.value = NULL;
-    return tree;
+// Spread the 8 bits of a channel so there are two empty bits between each of them
+static unsigned _octTree_spread(unsigned channel) {
+    channel = (channel | (channel << 8)) & 0x0300F00F;
+    channel = (channel | (channel << 4)) & 0x030C30C3;
+    channel = (channel | (channel << 2)) & 0x09249249;
+    return channel;
 }
 
-void octTree_destroy(OctTree* tree) {
-    if (tree->children) {
-        for (int i = 0; i < 8; i++) octTree_destroy(tree->children+i);
-        free(tree->children);
-    }
+unsigned octTree_morton(int key) {
+    unsigned r = (key >> 16) & UCHAR_MAX, g = (key >> 8) & UCHAR_MAX, b = key & UCHAR_MAX;
+    return _octTree_spread(r) | (_octTree_spread(g) << 1) | (_octTree_spread(b) << 2);
 }
 
-int _octTree_getRegion(OctTree* tree, Vector3* key) {
-    int rtn = 0;
-    if (key->x > tree->pos.x) rtn += 1;
-    if (key->y > tree->pos.y) rtn += 2;
-    if (key->z > tree->pos.z) rtn += 4;
-    return rtn;
+// The child index at a depth is the red, green, and blue bit at that depth in the low, middle, and high bit
+#define _octTree_getRegion(morton, depth) ((morton >> (3*(octTree_DEPTH-1-(depth)))) & 7)
+
+// The children before a region are counted using the mask, this gives the offset of that region from the first child
+#define _octTree_getChild(t, n, region) ((t)->children[n] + __builtin_popcount((t)->masks[n] & ((1u << (region))-1)))
+
+// Internal - Sort the entries by morton code, returns the entry indexes in sorted order; radix sort over 3 bytes
+static unsigned* _octTree_sortMorton(const HistogramEntry entries[], unsigned entriesLength, unsigned** mortons) {
+    unsigned* indexes = malloc(sizeof(unsigned)*entriesLength);
+    unsigned* nextIndexes = malloc(sizeof(unsigned)*entriesLength);
+    unsigned* codes = malloc(sizeof(unsigned)*entriesLength);
+    unsigned* nextCodes = malloc(sizeof(unsigned)*entriesLength);
+    for (unsigned i = 0; i < entriesLength; i++) {
+        indexes[i] = i;
+        codes[i] = octTree_morton(entries[i].key);
+    }
+
+    for (int shift = 0; shift < 24; shift += 8) {
+        unsigned offsets[256] = {0};
+        for (unsigned i = 0; i < entriesLength; i++) offsets[(codes[i] >> shift) & UCHAR_MAX]++;
+        for (unsigned i = 0, total = 0; i < 256; i++) {
+            unsigned count = offsets[i];
+            offsets[i] = total; total += count;
+        }
+        for (unsigned i = 0; i < entriesLength; i++) {
+            unsigned next = offsets[(codes[i] >> shift) & UCHAR_MAX]++;
+            nextIndexes[next] = indexes[i]; nextCodes[next] = codes[i];
+        }
+        unsigned* swap = indexes; indexes = nextIndexes; nextIndexes = swap;
+        swap = codes; codes = nextCodes; nextCodes = swap;
+    }
+
+    free(nextIndexes);
+    free(nextCodes);
+    *mortons = codes;
+    return indexes;
 }
 
-int octTree_getChildren(OctTree* tree, OctTree* children[]) {
-    if (!tree->children) return 0;
-    int nextIndex = 0;
-    for (int i = 0; i < 8; i++) {
-        if (tree->children[i].value || tree->children[i].children)
-            children[nextIndex++] = tree->children+i;
+// Internal - Total the count and sums of every inner node in a single post order pass
+// Children always come after their parent, so walking the pool backwards visits every child before its parent
+static void _octTree_aggregate(OctTree* tree) {
+    for (unsigned node = tree->length; node-- > 0;) {
+        if (octTree_isLeaf(tree, node)) continue;
+        unsigned count = 0;
+        OctTreeSum sum = {0, 0, 0};
+        unsigned first = tree->children[node], last = first + __builtin_popcount(tree->masks[node]);
+        for (unsigned child = first; child < last; child++) {
+            count += tree->counts[child];
+            sum.r += tree->sums[child].r; sum.g += tree->sums[child].g; sum.b += tree->sums[child].b;
+        }
+        tree->counts[node] = count;
+        tree->sums[node] = sum;
     }
-    return nextIndex;
 }
 
-void _octTree_createChildren(OctTree* tree) {
-    int halfSize = tree->size/2;
-    Vector3 pos = tree->pos;
-    tree->children = malloc(sizeof(OctTree)*8);
-    tree->children[0] = octTree_new(vector3_new(pos.x-halfSize, pos.y-halfSize, pos.z-halfSize), halfSize);
-    tree->children[1] = octTree_new(vector3_new(pos.x+halfSize, pos.y-halfSize, pos.z-halfSize), halfSize);
-    tree->children[2] = octTree_new(vector3_new(pos.x-halfSize, pos.y+halfSize, pos.z-halfSize), halfSize);
-    tree->children[3] = octTree_new(vector3_new(pos.x+halfSize, pos.y+halfSize, pos.z-halfSize), halfSize);
-    tree->children[4] = octTree_new(vector3_new(pos.x-halfSize, pos.y-halfSize, pos.z+halfSize), halfSize);
-    tree->children[5] = octTree_new(vector3_new(pos.x+halfSize, pos.y-halfSize, pos.z+halfSize), halfSize);
-    tree->children[6] = octTree_new(vector3_new(pos.x-halfSize, pos.y+halfSize, pos.z+halfSize), halfSize);
-    tree->children[7] = octTree_new(vector3_new(pos.x+halfSize, pos.y+halfSize, pos.z+halfSize), halfSize);
+void octTree_build(OctTree* tree, Arena* arena, const HistogramEntry entries[], unsigned entriesLength) {
+    unsigned* mortons;
+    unsigned* indexes = _octTree_sortMorton(entries, entriesLength, &mortons);
+
+    // Count the nodes, each entry adds one node below the deepest level it shares with the previous entry
+    unsigned length = entriesLength ? 1+octTree_DEPTH : 1;
+    for (unsigned i = 1; i < entriesLength; i++) {
+        unsigned diff = mortons[i] ^ mortons[i-1];
+        length += (31 - __builtin_clz(diff))/3 + 1;
+    }
+
+    tree->length = length;
+    tree->masks = arena_alloc(arena, sizeof(unsigned char)*length);
+    tree->children = arena_alloc(arena, sizeof(unsigned)*length);
+    tree->counts = arena_alloc(arena, sizeof(unsigned)*length);
+    tree->ranks = arena_alloc(arena, sizeof(unsigned)*length);
+    tree->sums = arena_alloc(arena, sizeof(OctTreeSum)*length);
+    tree->keys = arena_alloc(arena, sizeof(unsigned)*length);
+    tree->values = arena_alloc(arena, sizeof(unsigned)*length);
     #ifdef _DEBUG
-    for (int i = 0; i < 8; i++) tree->children[i].parent = tree;
+    tree->parents = arena_alloc(arena, sizeof(unsigned)*length);
+    tree->parents[octTree_ROOT] = octTree_NONE;
     #endif // _DEBUG
-}
 
-void octTree_setValue(OctTree* tree, Vector3* key, void* value) {
-    if (tree->value == NULL) {
-        // This node contains no key, so it can be inserted here
-        tree->key = *key;
-        tree->value = value;
-        return;
-    } else if (vector3_equals(&tree->key, key)) {
-        // This node contains the key, so set the value
-        tree->value = value;
-        return;
-    } else if (tree->children == NULL) {
-        // This node has a key, but no children, so children need to be created
-        _octTree_createChildren(tree);
+    // Each node covers a range of the sorted entries, these are only needed while building
+    unsigned* starts = malloc(sizeof(unsigned)*length);
+    unsigned* ends = malloc(sizeof(unsigned)*length);
+    unsigned char* depths = malloc(sizeof(unsigned char)*length);
+    starts[octTree_ROOT] = 0; ends[octTree_ROOT] = entriesLength; depths[octTree_ROOT] = 0;
+
+    // Nodes are created breadth first so the children of each node are appended next to each other
+    unsigned nextIndex = 1;
+    for (unsigned node = 0; node < length; node++) {
+        unsigned start = starts[node], end = ends[node], depth = depths[node];
+        unsigned char depthMask = (unsigned char)(UCHAR_MAX << (octTree_DEPTH-depth));
+        int firstKey = entriesLength ? entries[indexes[start]].key : 0;
+        tree->keys[node] = firstKey & ((depthMask << 16) | (depthMask << 8) | depthMask);
+        tree->masks[node] = 0;
+        tree->children[node] = nextIndex;
+        tree->values[node] = octTree_NONE;
+        tree->counts[node] = 0;
+        tree->ranks[node] = octTree_NONE;
+        tree->sums[node] = (OctTreeSum){0, 0, 0};
+
+        if (depth == octTree_DEPTH) {
+            // This is a leaf, so it holds exactly one entry
+            unsigned count = entries[indexes[start]].count, key = tree->keys[node];
+            tree->values[node] = indexes[start];
+            tree->counts[node] = count;
+            tree->sums[node] = (OctTreeSum){(unsigned long long)count*((key >> 16) & UCHAR_MAX), (unsigned long long)count*((key >> 8) & UCHAR_MAX), (unsigned long long)count*(key & UCHAR_MAX)};
+            continue;
+        }
+
+        // Split the range by region, the entries are sorted so each region is contiguous
+        for (unsigned i = start; i < end;) {
+            unsigned region = _octTree_getRegion(mortons[i], depth);
+            unsigned regionEnd = i+1;
+            while (regionEnd < end && _octTree_getRegion(mortons[regionEnd], depth) == region) regionEnd++;
+            tree->masks[node] |= 1 << region;
+            starts[nextIndex] = i; ends[nextIndex] = regionEnd; depths[nextIndex] = depth+1;
+            #ifdef _DEBUG
+            tree->parents[nextIndex] = node;
+            #endif // _DEBUG
+            nextIndex++;
+            i = regionEnd;
+        }
     }
-    
-    if (vector3_sqDistance(&tree->pos, key) < vector3_sqDistance(&tree->pos, &tree->key)) {
-        // The new key is closer to this node, so insert the current value into the best child
-        int region = _octTree_getRegion(tree, &tree->key);
-        octTree_setValue(tree->children+region, &tree->key, tree->value);
-        tree->key = *key; tree->value = value;
-    } else {
-        // Insert the key into the best child
-        int region = _octTree_getRegion(tree, key);
-        octTree_setValue(tree->children+region, key, value);
-    }    
+
+    _octTree_aggregate(tree);
+
+    free(starts);
+    free(ends);
+    free(depths);
+    free(indexes);
+    free(mortons);
 }
 
-void* octTree_getValue(OctTree* tree, Vector3* key) {
-    if (vector3_equals(&tree->key, key)) return tree->value;
-    if (tree->children == NULL) return NULL;
-    int region = _octTree_getRegion(tree, key);
-    return octTree_getValue(tree->children+region, key);
+int octTree_getChildren(const OctTree* tree, unsigned node, unsigned children[]) {
+    int childrenLength = __builtin_popcount(tree->masks[node]);
+    for (int i = 0; i < childrenLength; i++) children[i] = tree->children[node]+i;
+    return childrenLength;
+}
+
+unsigned octTree_getValue(const OctTree* tree, int key) {
+    unsigned morton = octTree_morton(key), node = octTree_ROOT;
+    for (int depth = 0; depth < octTree_DEPTH; depth++) {
+        unsigned region = _octTree_getRegion(morton, depth);
+        if (!(tree->masks[node] & (1 << region))) return octTree_NONE;
+        node = _octTree_getChild(tree, node, region);
+    }
+    return tree->values[node];
 }
 
 #ifdef _DEBUG
-OctTree* octTree_getSubTree(OctTree* tree, Vector3* key) {
-    if (vector3_equals(&tree->key, key)) return tree;
-    if (tree->children == NULL) return NULL;
-    int region = _octTree_getRegion(tree, key);
-    return octTree_getSubTree(tree->children+region, key);
+unsigned octTree_getSubTree(const OctTree* tree, int key) {
+    unsigned morton = octTree_morton(key), node = octTree_ROOT;
+    for (int depth = 0; depth < octTree_DEPTH; depth++) {
+        unsigned region = _octTree_getRegion(morton, depth);
+        if (!(tree->masks[node] & (1 << region))) return octTree_NONE;
+        node = _octTree_getChild(tree, node, region);
+    }
+    return node;
 }
 #endif
 
-void** octTree_values(OctTree* tree, void* values[], int* valuesLength, int* valuesSize) {
-    if (tree->value) {
-        if (*valuesLength > *valuesSize) {
-            *valuesSize *= 2;
-            values = realloc(values, sizeof(void*)*(*valuesSize));
+int octTree_visit(const OctTree* tree, unsigned node, OctTreePredicate prune, OctTreeVisitor visitor, void* context) {
+    if (octTree_isLeaf(tree, node)) return visitor(tree, node, context);
+
+    // Each level of the stack is the range of children still to be visited, there can never be more levels than the depth
+    unsigned nextChild[octTree_DEPTH], lastChild[octTree_DEPTH];
+    int top = 0;
+    nextChild[0] = tree->children[node];
+    lastChild[0] = nextChild[0] + __builtin_popcount(tree->masks[node]);
+
+    while (top >= 0) {
+        if (nextChild[top] == lastChild[top]) {
+            top--;
+            continue;
         }
-        values[(*valuesLength)++] = tree->value;
-    }
-    if (tree->children) {
-        for (int i = 0; i < 8; i++) values = octTree_values(tree->children+i, values, valuesLength, valuesSize);
-    }
-    return values;
-}
 
-void** octTree_valuesExcluding(OctTree* tree, HashMap* exclude, void* values[], int* valuesLength, int* valuesSize) {
-    if (*valuesLength > 0 && hashMap_includes(exclude, octTree_pointerHash(tree))) return values;
-    if (tree->value) {
-        if (*valuesLength > *valuesSize) {
-            *valuesSize *= 2;
-            values = realloc(values, sizeof(void*)*(*valuesSize));
+        unsigned child = nextChild[top]++;
+        if (prune && prune(tree, child, context)) continue;
+
+        if (octTree_isLeaf(tree, child)) {
+            if (visitor(tree, child, context)) return 1;
+        } else {
+            top++;
+            nextChild[top] = tree->children[child];
+            lastChild[top] = nextChild[top] + __builtin_popcount(tree->masks[child]);
         }
-        values[(*valuesLength)++] = tree->value;
-    }
-    if (tree->children) {
-        for (int i = 0; i < 8; i++) values = octTree_valuesExcluding(tree->children+i, exclude, values, valuesLength, valuesSize);
     }
-    return values;
-}
\ No newline at end of file
+
+    return 0;
+}
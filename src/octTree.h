@@ -1,39 +1,75 @@
 #ifndef __H_octTree
 #define __H_octTree
 
-#include "./vector3.h"
-#include "./hashMap.h"
+#include "./histogram.h"
+#include "./arena.h"
 #include <limits.h>
 
 //#define _INSPECT_octTree
 //#define _TESTS
 
+// Every key is a 24 bit colour and each level of the tree consumes one bit of each channel, so all values are stored at this depth
+#define octTree_DEPTH 8
+
+// Nodes are referred to by their index, the root is always the first node and children always come after their parent
+#define octTree_ROOT 0
+#define octTree_NONE UINT_MAX
+
+// The total of each channel over every pixel within a subtree
+typedef struct OctTreeSum {
+    unsigned long long r;
+    unsigned long long g;
+    unsigned long long b;
+} OctTreeSum;
+
+// A flat pool of nodes stored as a struct of arrays, the hot arrays are read by every traversal and the cold arrays only at the leaves
+// The children of a node are contiguous and in region order, bit i of a mask is set when the child for region i exists
 typedef struct OctTree {
+    unsigned char* masks;
+    unsigned* children;
+    unsigned* counts;
+    unsigned* ranks;
+    OctTreeSum* sums;
+    unsigned* keys;
+    unsigned* values;
     #ifdef _DEBUG
-    struct OctTree* parent;
+    unsigned* parents;
     #endif // _DEBUG
-    struct OctTree* children;
-    void* value;
-    Vector3 key;
-    Vector3 pos;
-    int size;
+    unsigned length;
 } OctTree;
 
-OctTree octTree_new(Vector3 pos, int size);
-void octTree_destroy(OctTree* tree);
+// Build a tree from a set of unique keys and their counts, the value of each leaf is the index of its entry
+// The count and channel sums of every subtree are aggregated once the tree is built, so reading them is O(1)
+// All arrays are allocated from the arena so there is no destroy method; destroy or reset the arena instead
+void octTree_build(OctTree* tree, Arena* arena, const HistogramEntry entries[], unsigned entriesLength);
+
+// Get the morton code of a key, the bits of each channel are interleaved so every 3 bits from the top select a child
+unsigned octTree_morton(int key);
+
+// A leaf is any node without children, every leaf holds a value
+#define octTree_isLeaf(t, n) ((t)->masks[n] == 0)
+
+// The rank of a node is the order it was selected in, octTree_NONE if never selected; a node is selected within the first k when its rank is less than k
+#define octTree_isSelected(t, n, k) ((t)->ranks[n] < (unsigned)(k))
+
+// Get the indexes of all children of a node, returns the number of children written
+int octTree_getChildren(const OctTree* tree, unsigned node, unsigned children[]);
 
-int octTree_getChildren(OctTree* tree, OctTree* children[]);
+// Get the value of a key, octTree_NONE is returned when the key is not in the tree
+unsigned octTree_getValue(const OctTree* tree, int key);
 
-void octTree_setValue(OctTree* tree, Vector3* key, void* value);
-void* octTree_getValue(OctTree* tree, Vector3* key);
+// Called for every leaf reached during a visit, return non zero to stop the visit early
+typedef int (*OctTreeVisitor)(const OctTree* tree, unsigned node, void* context);
 
-void** octTree_values(OctTree* tree, void* values[], int* valuesLength, int* valuesSize);
-void** octTree_valuesExcluding(OctTree* tree, HashMap* exclude, void* values[], int* valuesLength, int* valueSize);
+// Called before entering any node below the start of a visit, return non zero to skip that node and its subtree
+typedef int (*OctTreePredicate)(const OctTree* tree, unsigned node, void* context);
 
-#define octTree_pointerHash(p) (int)((size_t)p&INT_MAX)
+// Visit every leaf below a node in region order, prune can be NULL; returns non zero if the visit was stopped early
+// The visit uses a fixed size stack and never allocates, so it can be used inside any loop
+int octTree_visit(const OctTree* tree, unsigned node, OctTreePredicate prune, OctTreeVisitor visitor, void* context);
 
 #ifdef _DEBUG
-OctTree* octTree_getSubTree(OctTree* tree, Vector3* key);
+unsigned octTree_getSubTree(const OctTree* tree, int key);
 #endif // _DEBUG
 
-#endif // __H_octTree
\ No newline at end of file
+#endif // __H_octTree
@@ -0,0 +1,204 @@
+#include "./pixels.h"
+#include "./colour3.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef _TESTS
+#include <stdio.h>
+#endif // _TESTS
+
+// Packing is done byte by byte so the result matches the buffer layout on any platform
+unsigned pixels_pack(unsigned char r, unsigned char g, unsigned char b) {
+    unsigned packed;
+    unsigned char* bytes = (unsigned char*)&packed;
+    bytes[0] = r; bytes[1] = g; bytes[2] = b; bytes[3] = UCHAR_MAX;
+    return packed;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// Both x86 instruction sets are little endian, so red is the low byte of each pixel and blue is the third
+#if defined(__AVX2__)
+#define _pixels_WIDTH 8
+typedef __m256i _pixels_vector;
+#define _pixels_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define _pixels_store(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define _pixels_and(a, b) _mm256_and_si256(a, b)
+#define _pixels_or(a, b) _mm256_or_si256(a, b)
+#define _pixels_shiftLeft(v, n) _mm256_slli_epi32(v, n)
+#define _pixels_shiftRight(v, n) _mm256_srli_epi32(v, n)
+#define _pixels_set(n) _mm256_set1_epi32(n)
+#else
+#define _pixels_WIDTH 4
+typedef __m128i _pixels_vector;
+#define _pixels_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define _pixels_store(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define _pixels_and(a, b) _mm_and_si128(a, b)
+#define _pixels_or(a, b) _mm_or_si128(a, b)
+#define _pixels_shiftLeft(v, n) _mm_slli_epi32(v, n)
+#define _pixels_shiftRight(v, n) _mm_srli_epi32(v, n)
+#define _pixels_set(n) _mm_set1_epi32(n)
+#endif
+
+// Internal - Move red to the top byte and blue to the bottom byte of each pixel, dropping the alpha
+static inline _pixels_vector _pixels_toKeys4(const unsigned char* buffer) {
+    _pixels_vector pixels = _pixels_load(buffer);
+    _pixels_vector low = _pixels_set(0xFF), middle = _pixels_set(0xFF00);
+    _pixels_vector r = _pixels_shiftLeft(_pixels_and(pixels, low), 16);
+    _pixels_vector g = _pixels_and(pixels, middle);
+    _pixels_vector b = _pixels_and(_pixels_shiftRight(pixels, 16), low);
+    return _pixels_or(_pixels_or(r, g), b);
+}
+
+#if defined(__SSSE3__)
+// Internal - Shuffle each group of 3 bytes into a key in reverse order with a zero top byte, a whole vector is read but only 3/4 of it is used
+static inline _pixels_vector _pixels_toKeys3(const unsigned char* buffer) {
+    #if defined(__AVX2__)
+    // Shuffles stay within 16 byte lanes, so the second group of 12 bytes is first moved into the upper lane
+    _pixels_vector pixels = _mm256_permutevar8x32_epi32(_pixels_load(buffer), _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0));
+    return _mm256_shuffle_epi8(pixels, _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+    #else
+    return _mm_shuffle_epi8(_pixels_load(buffer), _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1));
+    #endif
+}
+#endif
+
+// Internal - The number of pixels at the start of a run which can be converted a vector at a time
+// Three channel loads read past the last pixel they use, so the run is shortened to keep every load within the buffer
+static inline size_t _pixels_vectorLength(size_t length, unsigned channels) {
+    if (channels == 4) return length - length % _pixels_WIDTH;
+    #if defined(__SSSE3__)
+    if (channels == 3 && length*3 >= sizeof(_pixels_vector)) {
+        size_t vectorLength = (length*3 - sizeof(_pixels_vector)) / 3 + _pixels_WIDTH;
+        return vectorLength - vectorLength % _pixels_WIDTH;
+    }
+    #endif
+    return 0;
+}
+
+// Internal - Convert the vector of pixels at the start of the buffer into keys
+static inline _pixels_vector _pixels_toKeys(const unsigned char* buffer, unsigned channels) {
+    #if defined(__SSSE3__)
+    if (channels == 3) return _pixels_toKeys3(buffer);
+    #endif
+    (void)channels;
+    return _pixels_toKeys4(buffer);
+}
+#endif
+
+void pixels_toKeys(const unsigned char* buffer, unsigned channels, unsigned* keys, size_t length) {
+    size_t i = 0;
+    #if defined(__AVX2__) || defined(__SSE2__)
+    size_t vectorLength = _pixels_vectorLength(length, channels);
+    for (; i < vectorLength; i += _pixels_WIDTH) {
+        _pixels_store(keys+i, _pixels_toKeys(buffer+i*channels, channels));
+    }
+    #endif
+
+    // Any remaining pixels, or all of them without simd
+    for (; i < length; i++) {
+        Colour3 color = colour3_fromBuffer(buffer, i*channels);
+        keys[i] = colour3_hash(color);
+    }
+}
+
+void pixels_remap(const unsigned char* buffer, unsigned channels, unsigned char* output, size_t length, const unsigned* indexes, const unsigned* pallet) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    // Both table reads are done with gathers, so a whole vector of pixels is remapped without leaving the registers
+    size_t vectorLength = _pixels_vectorLength(length, channels);
+    for (; i < vectorLength; i += _pixels_WIDTH) {
+        _pixels_vector keys = _pixels_toKeys(buffer+i*channels, channels);
+        _pixels_vector index = _mm256_i32gather_epi32((const int*)indexes, keys, 4);
+        _pixels_store(output+i*4, _mm256_i32gather_epi32((const int*)pallet, index, 4));
+    }
+    #elif defined(__SSE2__)
+    // There is no gather, so the keys are packed with simd and the table reads are done one at a time
+    unsigned keys[_pixels_WIDTH];
+    size_t vectorLength = _pixels_vectorLength(length, channels);
+    for (; i < vectorLength; i += _pixels_WIDTH) {
+        _pixels_store(keys, _pixels_toKeys(buffer+i*channels, channels));
+        _pixels_vector colours = _mm_set_epi32(pallet[indexes[keys[3]]], pallet[indexes[keys[2]]], pallet[indexes[keys[1]]], pallet[indexes[keys[0]]]);
+        _pixels_store(output+i*4, colours);
+    }
+    #endif
+
+    // Any remaining pixels, or all of them without simd
+    for (; i < length; i++) {
+        Colour3 color = colour3_fromBuffer(buffer, i*channels);
+        memcpy(output+i*4, pallet+indexes[colour3_hash(color)], 4);
+    }
+}
+
+void pixels_toIndexes(const unsigned char* buffer, unsigned channels, unsigned char* output, size_t length, const unsigned* indexes) {
+    size_t i = 0;
+    #if defined(__AVX2__) || defined(__SSE2__)
+    // The keys are packed with simd, each index is then a single table read narrowed to a byte
+    unsigned keys[_pixels_WIDTH];
+    size_t vectorLength = _pixels_vectorLength(length, channels);
+    for (; i < vectorLength; i += _pixels_WIDTH) {
+        _pixels_store(keys, _pixels_toKeys(buffer+i*channels, channels));
+        for (int j = 0; j < _pixels_WIDTH; j++) output[i+j] = (unsigned char)indexes[keys[j]];
+    }
+    #endif
+
+    // Any remaining pixels, or all of them without simd
+    for (; i < length; i++) {
+        Colour3 color = colour3_fromBuffer(buffer, i*channels);
+        output[i] = (unsigned char)indexes[colour3_hash(color)];
+    }
+}
+
+#ifdef _TESTS
+// Test the kernels against the scalar macros on random pixels of both channel counts
+// Every length up to one which does not fill the last vector is tested, so the shortened three channel runs are covered
+#define pixelsArraySize 1027
+void _test_pixels() {
+    printf("\n_test_pixels\n");
+
+    static unsigned char buffer[pixelsArraySize*4], output[pixelsArraySize*4];
+    static unsigned keys[pixelsArraySize], indexes[1 << 24];
+    unsigned pallet[7];
+    for (int i = 0; i < pixelsArraySize*4; i++) buffer[i] = (unsigned char)rand();
+    for (int i = 0; i < 7; i++) pallet[i] = pixels_pack((unsigned char)(i*30), (unsigned char)(i*20), (unsigned char)(i*10));
+    for (unsigned channels = 3; channels <= 4; channels++) {
+        for (int i = 0; i < pixelsArraySize; i++) {
+            Colour3 color = colour3_fromBuffer(buffer, i*channels);
+            unsigned key = colour3_hash(color);
+            indexes[key] = key % 7;
+        }
+
+        int keyErrors = 0, remapErrors = 0, indexErrors = 0;
+        for (int length = 0; length <= pixelsArraySize; length += length < 40 ? 1 : 987) {
+            // Every key must match colour3_hash
+            pixels_toKeys(buffer, channels, keys, length);
+            for (int i = 0; i < length; i++) {
+                Colour3 color = colour3_fromBuffer(buffer, i*channels);
+                unsigned key = colour3_hash(color);
+                if (keys[i] != key) keyErrors++;
+            }
+
+            // Every output pixel must be the pallet colour for its key with an alpha of 255
+            pixels_remap(buffer, channels, output, length, indexes, pallet);
+            for (int i = 0; i < length; i++) {
+                int index = keys[i] % 7;
+                if (output[i*4] != index*30 || output[i*4+1] != index*20 || output[i*4+2] != index*10 || output[i*4+3] != UCHAR_MAX) remapErrors++;
+            }
+
+            // Every output index must be the index table entry for its key
+            pixels_toIndexes(buffer, channels, output, length, indexes);
+            for (int i = 0; i < length; i++) {
+                if (output[i] != keys[i] % 7) indexErrors++;
+            }
+        }
+        printf("# Channels %u - Key Errors %i - Remap Errors %i - Index Errors %i\n", channels, keyErrors, remapErrors, indexErrors);
+    }
+}
+#endif // _TESTS
@@ -0,0 +1,31 @@
+#ifndef __H_pixels
+#define __H_pixels
+
+#include <stdlib.h>
+
+//#define _TESTS
+
+// Kernels which work on whole runs of RGB or RGBA pixels at once, the widest instruction set enabled at compile time is used
+// AVX2 is used when compiled with -mavx2 or -march=native, otherwise SSE2 on x86 and a scalar loop everywhere else
+// Three channel pixels need a byte shuffle, so they are only vectorised when SSSE3 or AVX2 is enabled
+
+// The number of pixels callers should process per call when using a buffer on the stack
+#define pixels_BLOCK 1024
+
+// Pack a 3 channel colour into the same byte order as an RGBA pixel, with the alpha set to 255
+unsigned pixels_pack(unsigned char r, unsigned char g, unsigned char b);
+
+// Convert length pixels of 3 or 4 channels into their colour3_hash keys
+void pixels_toKeys(const unsigned char* buffer, unsigned channels, unsigned* keys, size_t length);
+
+// Write the packed pallet colour at the index table entry for the key of each of length pixels as RGBA
+void pixels_remap(const unsigned char* buffer, unsigned channels, unsigned char* output, size_t length, const unsigned* indexes, const unsigned* pallet);
+
+// Write the single byte index table entry for the key of each of length pixels
+void pixels_toIndexes(const unsigned char* buffer, unsigned channels, unsigned char* output, size_t length, const unsigned* indexes);
+
+#ifdef _TESTS
+void _test_pixels();
+#endif // _TESTS
+
+#endif // __H_pixels
@@ -0,0 +1,236 @@
+#include "./reduce.h"
+#include "./priorityQueue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// A subtree waiting in the queue and the index of the selected subtree which currently owns its colours
+typedef struct SelectCandidate {
+    unsigned tree;
+    int owner;
+} SelectCandidate;
+
+// The state shared by the callbacks used when refining
+typedef struct AssignContext {
+    int length;
+    unsigned* indexes;
+    unsigned index;
+} AssignContext;
+
+// The keys are packed a block at a time by the pixel kernel, leaving only the counting to this loop
+void countPixels(Histogram* histogram, Image image, unsigned startRow, unsigned endRow) {
+    unsigned keys[pixels_BLOCK];
+    for (unsigned y = startRow; y < endRow; y++) {
+        const unsigned char* row = imageRow(image, y);
+        for (size_t i = 0; i < image.width; i += pixels_BLOCK) {
+            size_t blockLength = image.width-i < pixels_BLOCK ? image.width-i : pixels_BLOCK;
+            pixels_toKeys(row+i*image.channels, image.channels, keys, blockLength);
+            for (size_t j = 0; j < blockLength; j++) {
+                histogram_add(histogram, keys[j]);
+            }
+        }
+    }
+}
+
+// Compact the histogram into the unique colours, the tree is built from them in one go
+size_t insertColours(const Histogram* histogram, OctTree* tree, Arena* arena) {
+    HistogramEntry* entries;
+    size_t entriesLength = histogram_compact(histogram, &entries);
+    octTree_build(tree, arena, entries, entriesLength);
+    free(entries);
+    return entriesLength;
+}
+
+// Internal - Push every non empty child of a subtree into the queue, all of them start owned by the same selected subtree
+static void _selectNodes_pushChildren(PriorityQueue* queue, SelectCandidate** candidates, int* candidatesLength, int* candidatesSize, const OctTree* tree, unsigned node, int owner) {
+    unsigned children[8];
+    int childrenLength = octTree_getChildren(tree, node, children);
+    for (int i = 0; i < childrenLength; i++) {
+        if (*candidatesLength == *candidatesSize) {
+            *candidatesSize *= 2;
+            *candidates = realloc(*candidates, sizeof(SelectCandidate)*(*candidatesSize));
+        }
+        (*candidates)[*candidatesLength] = (SelectCandidate){children[i], owner};
+        priorityQueue_push(queue, (int)tree->counts[children[i]], (void*)(size_t)(*candidatesLength)++);
+    }
+}
+
+// Select subtrees largest first, each selected subtree takes its colours from the selected subtree above it
+// A subtree which would take every remaining colour from its owner is passed over so no pallet colour is left empty
+void selectNodes(OctTree* tree, unsigned selected[], int owners[], int* selectedLength, int selectedSize) {
+    if (!tree->counts[octTree_ROOT] || selectedSize <= 0) return;
+
+    PriorityQueue* queue = priorityQueue_preAlloc(selectedSize*8);
+    int candidatesLength = 0, candidatesSize = selectedSize*8;
+    SelectCandidate* candidates = malloc(sizeof(SelectCandidate)*candidatesSize);
+    unsigned* remaining = malloc(sizeof(unsigned)*selectedSize);
+
+    // The whole tree is always the first selection
+    remaining[0] = tree->counts[octTree_ROOT];
+    owners[0] = -1;
+    tree->ranks[octTree_ROOT] = *selectedLength;
+    selected[(*selectedLength)++] = octTree_ROOT;
+    _selectNodes_pushChildren(queue, &candidates, &candidatesLength, &candidatesSize, tree, octTree_ROOT, 0);
+
+    while (*selectedLength < selectedSize && priorityQueue_hasNext(queue)) {
+        SelectCandidate candidate = candidates[(size_t)priorityQueue_pop(queue)];
+        unsigned count = tree->counts[candidate.tree];
+        int owner = candidate.owner;
+
+        if (remaining[owner] > count) {
+            // The owner keeps some colours, so this subtree becomes a new selection and owns all of its own colours
+            remaining[owner] -= count;
+            owners[*selectedLength] = owner;
+            owner = *selectedLength;
+            remaining[owner] = count;
+            tree->ranks[candidate.tree] = *selectedLength;
+            selected[(*selectedLength)++] = candidate.tree;
+        }
+
+        _selectNodes_pushChildren(queue, &candidates, &candidatesLength, &candidatesSize, tree, candidate.tree, owner);
+    }
+
+    priorityQueue_destroy(queue);
+    free(candidates);
+    free(remaining);
+}
+
+// Allocate a refinement, the ranks stored in the tree by selectNodes are used to tell which subtrees are selected
+// The index table has an entry for every possible key, only the pages holding keys in the tree are ever touched
+Refinement* refinement_new(const OctTree* tree, const unsigned selected[], const int owners[], int selectedLength) {
+    Refinement* refinement = malloc(sizeof(Refinement));
+    size_t size = selectedLength ? selectedLength : 1;
+    refinement->tree = tree;
+    refinement->selected = selected; refinement->owners = owners;
+    refinement->counts = malloc(sizeof(unsigned)*size);
+    refinement->sums = malloc(sizeof(OctTreeSum)*size);
+    refinement->pallet = malloc(sizeof(Colour3)*size);
+    refinement->packed = malloc(sizeof(unsigned)*size);
+    refinement->indexes = calloc(histogram_KEYS, sizeof(unsigned));
+    refinement->length = 0;
+    refinement->size = (int)size;
+    return refinement;
+}
+
+// Reset a refinement for another tree, the running totals are only reallocated when there are more selections than before
+// Keys which are not in the new tree keep stale indexes, but no pixel of an image built into the tree can have one of those keys
+void refinement_reset(Refinement* refinement, const OctTree* tree, const unsigned selected[], const int owners[], int selectedLength) {
+    refinement->tree = tree;
+    refinement->selected = selected; refinement->owners = owners;
+    refinement->length = 0;
+    if (selectedLength > refinement->size) {
+        size_t size = selectedLength;
+        refinement->counts = realloc(refinement->counts, sizeof(unsigned)*size);
+        refinement->sums = realloc(refinement->sums, sizeof(OctTreeSum)*size);
+        refinement->pallet = realloc(refinement->pallet, sizeof(Colour3)*size);
+        refinement->packed = realloc(refinement->packed, sizeof(unsigned)*size);
+        refinement->size = selectedLength;
+    }
+}
+
+// Destroy a refinement, freeing its pallet, index table, and running totals
+void refinement_destroy(Refinement* refinement) {
+    free(refinement->indexes);
+    free(refinement->counts);
+    free(refinement->sums);
+    free(refinement->pallet);
+    free(refinement->packed);
+    free(refinement);
+}
+
+// Internal - Skip any subtree which is its own selection within the pallet
+static int _refinement_prune(const OctTree* tree, unsigned node, void* context) {
+    return octTree_isSelected(tree, node, ((AssignContext*)context)->length);
+}
+
+// Internal - Point the colour key of this leaf at the current pallet index
+static int _refinement_visit(const OctTree* tree, unsigned node, void* context) {
+    AssignContext* assign = context;
+    assign->indexes[tree->keys[node]] = assign->index;
+    return 0;
+}
+
+// Internal - Calculate the weighted average of a selection, selection never leaves an owner without colours
+static void _refinement_average(Refinement* refinement, int index) {
+    unsigned count = refinement->counts[index];
+    OctTreeSum sum = refinement->sums[index];
+    Colour3 colour = colour3_new(sum.r/count, sum.g/count, sum.b/count);
+    refinement->pallet[index] = colour;
+    refinement->packed[index] = pixels_pack(colour.r, colour.g, colour.b);
+}
+
+// Each new selection starts with the aggregates of its whole subtree and takes them from its owner
+// Owners are always selected before the subtrees they own, so only the new selections and their owners change
+void refinement_refine(Refinement* refinement, int length) {
+    const OctTree* tree = refinement->tree;
+    int previousLength = refinement->length;
+
+    for (int i = previousLength; i < length; i++) {
+        unsigned node = refinement->selected[i];
+        refinement->counts[i] = tree->counts[node];
+        refinement->sums[i] = tree->sums[node];
+        if (i == 0) continue;
+
+        int owner = refinement->owners[i];
+        refinement->counts[owner] -= tree->counts[node];
+        refinement->sums[owner].r -= tree->sums[node].r; refinement->sums[owner].g -= tree->sums[node].g; refinement->sums[owner].b -= tree->sums[node].b;
+    }
+
+    // Recalculate the colours which changed, an owner may be recalculated more than once
+    for (int i = previousLength; i < length; i++) {
+        _refinement_average(refinement, i);
+        if (i > 0) _refinement_average(refinement, refinement->owners[i]);
+    }
+
+    // Only the leaves of the new selections change owner, the visits stop at any subtree selected within the new length
+    AssignContext context = {length, refinement->indexes, 0};
+    for (int i = previousLength; i < length; i++) {
+        context.index = i;
+        octTree_visit(tree, refinement->selected[i], _refinement_prune, _refinement_visit, &context);
+    }
+
+    refinement->length = length;
+}
+
+// Each pixel is a single read of the index table followed by a read of the pallet, which is small enough to stay in cache
+// The packed pallet already has its alpha set, so whole pixels are written by the kernel without touching single channels
+void remapPixels(const Refinement* refinement, Image image, Image output, unsigned startRow, unsigned endRow) {
+    for (unsigned y = startRow; y < endRow; y++) {
+        pixels_remap(imageRow(image, y), image.channels, imageRow(output, y), image.width, refinement->indexes, refinement->packed);
+    }
+}
+
+// Only one byte is written per pixel, a quarter of the writes made by remapPixels
+void remapIndexes(const Refinement* refinement, Image image, IndexedImage output, unsigned startRow, unsigned endRow) {
+    for (unsigned y = startRow; y < endRow; y++) {
+        pixels_toIndexes(imageRow(image, y), image.channels, output.buffer+(size_t)y*output.width, image.width, refinement->indexes);
+    }
+}
+
+// The pallet is stored as rgb triples within the indexed image, ready to be written as a PLTE chunk
+void copyPallet(const Refinement* refinement, IndexedImage* output) {
+    for (int index = 0; index < refinement->length; index++) {
+        Colour3 colour = refinement->pallet[index];
+        output->pallet[index*3] = colour.r; output->pallet[index*3+1] = colour.g; output->pallet[index*3+2] = colour.b;
+    }
+    output->palletLength = refinement->length;
+}
+
+// Cells past the last colour are cleared, otherwise they would keep colours from a previous pallet
+void drawPallet(const Refinement* refinement, Image* pallet, int desired) {
+    int palletSize = reduce_PALLET_SCALE*(int)ceil(sqrt(desired));
+    resizeImage(pallet, palletSize, palletSize);
+    memset(pallet->buffer, 0, pallet->stride*pallet->height);
+    for (int index = 0; index < desired; index++) {
+        Colour3 colour = refinement->pallet[index];
+
+        // Add the colour to the pallet image
+        int row = reduce_PALLET_SCALE*((index*reduce_PALLET_SCALE) / pallet->width);
+        int column = (index*reduce_PALLET_SCALE) % pallet->width;
+        for (int ri = 0; ri < reduce_PALLET_SCALE; ri++) for (int ci = 0; ci < reduce_PALLET_SCALE; ci++) {
+            int idx = ((row+ri)*pallet->width+column+ci)*4;
+            colour3_toBufferWithAlpha(colour, pallet->buffer, idx, 255);
+        }
+    }
+}
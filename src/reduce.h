@@ -0,0 +1,69 @@
+#ifndef __H_reduce
+#define __H_reduce
+
+#include "./histogram.h"
+#include "./octTree.h"
+#include "./colour3.h"
+#include "./arena.h"
+#include "./images.h"
+#include "./pixels.h"
+
+// Count the colour of every pixel from startRow up to endRow into the histogram, separate row ranges can be counted into separate histograms at the same time
+void countPixels(Histogram* histogram, Image image, unsigned startRow, unsigned endRow);
+
+// Compact a histogram into its unique colours and build the tree from them in the arena, returns the number of unique colours
+size_t insertColours(const Histogram* histogram, OctTree* tree, Arena* arena);
+
+// Select the subtrees which will each become one colour in the pallet, in the order they should be used
+// The owner of each selection is the index of the earlier selection it takes its colours from, the first selection has no owner
+// The rank of each selected node is set to its index within selected, so the selections within any pallet length can be tested in O(1)
+void selectNodes(OctTree* tree, unsigned selected[], int owners[], int* selectedLength, int selectedSize);
+
+// The pallet built from the first length selections, growing it only updates the selections and colours which change
+// Every colour key maps to the index of its pallet colour, so changing a pallet colour never requires the colours to be visited
+typedef struct Refinement {
+    const OctTree* tree;
+    const unsigned* selected;
+    const int* owners;
+    unsigned* counts;
+    OctTreeSum* sums;
+    Colour3* pallet;
+    unsigned* packed;
+    unsigned* indexes;
+    int length;
+    int size;
+} Refinement;
+
+// Allocate a new refinement with an empty pallet, enough room is allocated for every selection
+Refinement* refinement_new(const OctTree* tree, const unsigned selected[], const int owners[], int selectedLength);
+
+// Reset a refinement to an empty pallet for a new tree and selections, the index table is kept as the first refine assigns every colour of the tree
+void refinement_reset(Refinement* refinement, const OctTree* tree, const unsigned selected[], const int owners[], int selectedLength);
+
+// Destroy a refinement instance, freeing its pallet and index table
+void refinement_destroy(Refinement* refinement);
+
+// Get the pallet colour of any colour key within the tree, this is a single table read
+// The packed pallet holds the same colours in the byte order of an RGBA pixel so the remap can copy them whole
+#define refinement_getIndex(r, k) (r)->indexes[k]
+#define refinement_getColour(r, k) (r)->pallet[(r)->indexes[k]]
+
+// Grow the pallet to contain the first length selections, length can not be less than the current length
+void refinement_refine(Refinement* refinement, int length);
+
+// Copy the pallet colour of every pixel from startRow up to endRow into the RGBA output, separate row ranges can be remapped at the same time
+void remapPixels(const Refinement* refinement, Image image, Image output, unsigned startRow, unsigned endRow);
+
+// Copy the pallet index of every pixel from startRow up to endRow into the output, the refinement must be no longer than images_MAX_PALLET
+void remapIndexes(const Refinement* refinement, Image image, IndexedImage output, unsigned startRow, unsigned endRow);
+
+// Copy the current pallet of the refinement into an indexed image, the refinement must be no longer than images_MAX_PALLET
+void copyPallet(const Refinement* refinement, IndexedImage* output);
+
+// The width and height of the block drawn for each colour of a pallet image
+#define reduce_PALLET_SCALE 4
+
+// Draw each colour of the pallet as a square block into an RGBA image, the image is resized to fit the number of colours
+void drawPallet(const Refinement* refinement, Image* pallet, int desired);
+
+#endif // __H_reduce
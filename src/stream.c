@@ -0,0 +1,348 @@
+#include "./stream.h"
+
+#include <string.h>
+
+#ifdef _TESTS
+#include "../libs/lodepng/lodepng.h"
+#endif // _TESTS
+
+// The largest amount of data which can be held in one stored deflate block
+#define _stream_BLOCK_SIZE 65535
+
+// The most of the start of a file which is read to find the end of its header, longer headers are only possible with long comments
+#define _stream_HEADER_SIZE 4096
+
+StreamReader* streamReader_open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    // The header is parsed from the start of the file, then the file is moved to the first row
+    unsigned char start[_stream_HEADER_SIZE];
+    size_t startSize = fread(start, 1, sizeof(start), file);
+    NetpbmHeader header;
+    if (!parseNetpbmHeader(start, startSize, &header)) {
+        fclose(file);
+        return NULL;
+    }
+    fseek(file, (long)header.headerSize, SEEK_SET);
+
+    StreamReader* reader = malloc(sizeof(StreamReader));
+    *reader = (StreamReader){file, header.width, header.height, header.channels, (long)header.headerSize, 0};
+    return reader;
+}
+
+void streamReader_close(StreamReader* reader) {
+    fclose(reader->file);
+    free(reader);
+}
+
+Image streamReader_newStrip(const StreamReader* reader, unsigned rows) {
+    size_t stride = (size_t)reader->width*reader->channels;
+    return (Image){reader->width, rows, reader->channels, stride, stride*rows, malloc(stride*rows), NULL, 0};
+}
+
+unsigned streamReader_read(StreamReader* reader, Image* strip, unsigned rows) {
+    if (rows > strip->bufferSize / strip->stride) rows = (unsigned)(strip->bufferSize / strip->stride);
+    if (rows > reader->height - reader->row) rows = reader->height - reader->row;
+    if (rows && fread(strip->buffer, strip->stride, rows, reader->file) != rows) {
+        fprintf(stderr, "error: image data ends before the last row\n");
+        exit(1);
+    }
+    reader->row += rows;
+    strip->height = rows;
+    return rows;
+}
+
+void streamReader_rewind(StreamReader* reader) {
+    fseek(reader->file, reader->dataOffset, SEEK_SET);
+    reader->row = 0;
+}
+
+// Internal - Update a crc32 a nibble at a time, the table is small enough to be a constant so no setup is needed
+static unsigned _stream_crc(unsigned crc, const unsigned char* data, size_t length) {
+    static const unsigned table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return crc;
+}
+
+// Internal - Write a 32 bit value with the most significant byte first, as every png value is stored
+static void _stream_write32(FILE* file, unsigned value) {
+    unsigned char bytes[4] = {(unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value};
+    fwrite(bytes, 1, 4, file);
+}
+
+// Internal - Write a png chunk, the crc covers the type and the data
+static void _stream_writeChunk(FILE* file, const char* type, const unsigned char* data, size_t length) {
+    _stream_write32(file, (unsigned)length);
+    fwrite(type, 1, 4, file);
+    if (length) fwrite(data, 1, length, file);
+    unsigned crc = _stream_crc(0xFFFFFFFF, (const unsigned char*)type, 4);
+    crc = _stream_crc(crc, data, length);
+    _stream_write32(file, crc ^ 0xFFFFFFFF);
+}
+
+StreamWriter* streamWriter_open(const char* path, ImageFormat format, unsigned width, unsigned height, unsigned channels, const IndexedImage* pallet) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "error: could not open %s for writing\n", path);
+        exit(1);
+    }
+
+    StreamWriter* writer = malloc(sizeof(StreamWriter));
+    if (channels != 1) format = fullColourFormat(format);
+    unsigned bitDepth = 8;
+    if (channels == 1 && format == IMAGE_PNG) bitDepth = pallet->palletLength <= 2 ? 1 : pallet->palletLength <= 4 ? 2 : pallet->palletLength <= 16 ? 4 : 8;
+    *writer = (StreamWriter){file, format, width, height, channels, bitDepth, 0, ((size_t)width*channels*bitDepth + 7) / 8, 1, 0, NULL, 0, {0}, NULL};
+    if (channels == 1) memcpy(writer->pallet, pallet->pallet, sizeof(writer->pallet));
+
+    // Uncompressed formats only have a header, the rows follow it directly
+    if (format == IMAGE_PAM) {
+        writePAMHeader(file, width, height, channels == 1 ? 3 : channels);
+        return writer;
+    } else if (format == IMAGE_RAW) {
+        writeRawHeader(file, width, height, pallet);
+        return writer;
+    } else if (format == IMAGE_GIF) {
+        gif_writeHeader(file, width, height, pallet, 0);
+        writer->gif = gif_newEncoder();
+        gif_beginFrame(writer->gif, width, height, pallet->palletLength, 0);
+        gif_flush(writer->gif, file);
+        return writer;
+    }
+
+    // The header is written straight away, the image data follows in one chunk per strip
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, 1, 8, file);
+    unsigned char header[13] = {
+        (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+        (unsigned char)bitDepth, (unsigned char)(channels == 1 ? 3 : channels == 3 ? 2 : 6), 0, 0, 0
+    };
+    _stream_writeChunk(file, "IHDR", header, 13);
+    if (channels == 1) _stream_writeChunk(file, "PLTE", pallet->pallet, (size_t)pallet->palletLength*3);
+    return writer;
+}
+
+void streamWriter_write(StreamWriter* writer, const unsigned char* buffer, size_t stride, unsigned rows) {
+    if (!rows) return;
+
+    // Each strip of a gif is compressed and written straight away
+    if (writer->format == IMAGE_GIF) {
+        for (unsigned y = 0; y < rows; y++) gif_encode(writer->gif, buffer + y*stride, writer->width);
+        gif_flush(writer->gif, writer->file);
+        writer->row += rows;
+        return;
+    }
+
+    // Indexed rows are expanded to RGB for a PAM, every other uncompressed row is written as it is
+    if (writer->format != IMAGE_PNG) {
+        int expand = writer->format == IMAGE_PAM && writer->channels == 1;
+        if (expand && writer->bufferSize < (size_t)writer->width*3) {
+            writer->bufferSize = (size_t)writer->width*3;
+            writer->buffer = realloc(writer->buffer, writer->bufferSize);
+        }
+        for (unsigned y = 0; y < rows; y++) {
+            const unsigned char* source = buffer + y*stride;
+            if (expand) {
+                for (unsigned x = 0; x < writer->width; x++) memcpy(writer->buffer+x*3, writer->pallet+source[x]*3, 3);
+                fwrite(writer->buffer, 3, writer->width, writer->file);
+            } else {
+                fwrite(source, 1, writer->lineSize, writer->file);
+            }
+        }
+        writer->row += rows;
+        return;
+    }
+
+    // Every row is given a filter byte of 0 and split across stored blocks, the zlib header is only written before the first row
+    size_t rawSize = (size_t)rows*(writer->lineSize+1);
+    size_t blocks = (rawSize + _stream_BLOCK_SIZE - 1) / _stream_BLOCK_SIZE;
+    size_t headerSize = writer->row ? 0 : 2;
+    size_t chunkSize = headerSize + blocks*5 + rawSize;
+    if (rawSize + chunkSize > writer->bufferSize) {
+        writer->bufferSize = rawSize + chunkSize;
+        writer->buffer = realloc(writer->buffer, writer->bufferSize);
+    }
+    unsigned char* raw = writer->buffer;
+    unsigned char* chunk = writer->buffer + rawSize;
+
+    // Indexes below 8 bits are packed with the first pixel in the highest bits of each byte
+    for (unsigned y = 0; y < rows; y++) {
+        unsigned char* line = raw + y*(writer->lineSize+1);
+        const unsigned char* source = buffer + y*stride;
+        line[0] = 0;
+        if (writer->bitDepth < 8) {
+            unsigned perByte = 8 / writer->bitDepth;
+            memset(line+1, 0, writer->lineSize);
+            for (unsigned x = 0; x < writer->width; x++) {
+                line[1 + x/perByte] |= source[x] << (8 - writer->bitDepth*(x%perByte+1));
+            }
+        } else {
+            memcpy(line+1, source, writer->lineSize);
+        }
+    }
+
+    // The adler32 of the zlib stream covers the raw rows, the sums are reduced often enough that they never overflow
+    for (size_t i = 0; i < rawSize;) {
+        size_t end = i + 5552 < rawSize ? i + 5552 : rawSize;
+        for (; i < end; i++) {
+            writer->adlerA += raw[i];
+            writer->adlerB += writer->adlerA;
+        }
+        writer->adlerA %= 65521; writer->adlerB %= 65521;
+    }
+
+    unsigned char* position = chunk;
+    if (headerSize) {
+        *position++ = 0x78; *position++ = 0x01;
+    }
+    for (size_t i = 0; i < rawSize; i += _stream_BLOCK_SIZE) {
+        size_t length = rawSize - i < _stream_BLOCK_SIZE ? rawSize - i : _stream_BLOCK_SIZE;
+        position[0] = 0;
+        position[1] = (unsigned char)length; position[2] = (unsigned char)(length >> 8);
+        position[3] = (unsigned char)~length; position[4] = (unsigned char)(~length >> 8);
+        memcpy(position+5, raw+i, length);
+        position += 5 + length;
+    }
+    _stream_writeChunk(writer->file, "IDAT", chunk, chunkSize);
+    writer->row += rows;
+}
+
+void streamWriter_close(StreamWriter* writer) {
+    if (writer->row != writer->height) {
+        fprintf(stderr, "error: %u of %u rows were written\n", writer->row, writer->height);
+        exit(1);
+    }
+
+    // An empty final block ends the deflate stream, followed by the adler32 of everything before it
+    if (writer->format == IMAGE_PNG) {
+        unsigned adler = (writer->adlerB << 16) | writer->adlerA;
+        unsigned char end[9] = {1, 0, 0, 0xFF, 0xFF, (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler};
+        _stream_writeChunk(writer->file, "IDAT", end, 9);
+        _stream_writeChunk(writer->file, "IEND", NULL, 0);
+    } else if (writer->format == IMAGE_GIF) {
+        gif_endFrame(writer->gif);
+        gif_flush(writer->gif, writer->file);
+        gif_writeTrailer(writer->file);
+        gif_destroyEncoder(writer->gif);
+    }
+
+    fclose(writer->file);
+    free(writer->buffer);
+    free(writer);
+}
+
+#ifdef _TESTS
+// Write a PAM and read it back in strips which do not divide its height, then stream it into a png and decode it with lodepng
+#define streamTestWidth 37
+#define streamTestHeight 23
+void _test_stream() {
+    printf("\n_test_stream\n");
+
+    static unsigned char pixels[streamTestWidth*streamTestHeight*4];
+    for (int i = 0; i < streamTestWidth*streamTestHeight*4; i++) pixels[i] = (unsigned char)rand();
+    const char* pamPath = "_test_stream.pam";
+    const char* pngPath = "_test_stream.png";
+
+    FILE* file = fopen(pamPath, "wb");
+    fprintf(file, "P7\nWIDTH %i\nHEIGHT %i\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", streamTestWidth, streamTestHeight);
+    fwrite(pixels, 4, streamTestWidth*streamTestHeight, file);
+    fclose(file);
+
+    // Read the pam twice, both reads must match the pixels written
+    int errors = 0;
+    StreamReader* reader = streamReader_open(pamPath);
+    Image strip = streamReader_newStrip(reader, 7);
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned row = 0;
+        while (streamReader_read(reader, &strip, 5)) {
+            if (memcmp(strip.buffer, pixels + row*streamTestWidth*4, strip.height*strip.stride) != 0) errors++;
+            row += strip.height;
+        }
+        if (row != streamTestHeight) errors++;
+        streamReader_rewind(reader);
+    }
+    printf("# Read %ix%i in strips - Errors %i\n", streamTestWidth, streamTestHeight, errors);
+
+    // Stream the pixels into a png with uneven strips, it must decode to the same pixels
+    errors = 0;
+    StreamWriter* writer = streamWriter_open(pngPath, IMAGE_PNG, streamTestWidth, streamTestHeight, 4, NULL);
+    while (streamReader_read(reader, &strip, 7)) streamWriter_write(writer, strip.buffer, strip.stride, strip.height);
+    streamWriter_close(writer);
+
+    unsigned char* decoded; unsigned width, height;
+    if (lodepng_decode32_file(&decoded, &width, &height, pngPath) || width != streamTestWidth || height != streamTestHeight) {
+        errors++;
+    } else {
+        if (memcmp(decoded, pixels, sizeof(pixels)) != 0) errors++;
+        free(decoded);
+    }
+    printf("# Write %ix%i in strips - Errors %i\n", streamTestWidth, streamTestHeight, errors);
+
+    // Read the whole pam at once without an extension, it must be found from its contents and be the same pixels as the strips
+    errors = 0;
+    const char* barePath = "_test_stream";
+    rename(pamPath, barePath);
+    Image image = readImage(barePath);
+    rename(barePath, pamPath);
+    if (image.width != streamTestWidth || image.height != streamTestHeight || image.channels != 4) {
+        errors++;
+    } else if (memcmp(image.buffer, pixels, sizeof(pixels)) != 0) {
+        errors++;
+    }
+    destroyImage(&image);
+    printf("# Read %ix%i whole - Errors %i\n", streamTestWidth, streamTestHeight, errors);
+
+    // Write an indexed image whole and in strips as each indexed format, the files must be the same
+    // The raw index plane must start at its fixed offset, and the pam must be the indexes expanded through the pallet, the gif is decoded by _test_gif
+    errors = 0;
+    IndexedImage indexed = newIndexedImage(streamTestHeight, streamTestWidth);
+    indexed.palletLength = 5;
+    for (int i = 0; i < 15; i++) indexed.pallet[i] = (unsigned char)rand();
+    for (int i = 0; i < streamTestWidth*streamTestHeight; i++) indexed.buffer[i] = (unsigned char)(rand() % 5);
+    for (ImageFormat format = IMAGE_PAM; format <= IMAGE_GIF; format++) {
+        writeIndexedImage(indexed, pamPath, format);
+        writer = streamWriter_open(pngPath, format, streamTestWidth, streamTestHeight, 1, &indexed);
+        for (unsigned row = 0; row < streamTestHeight; row += 7) {
+            unsigned rows = streamTestHeight - row < 7 ? streamTestHeight - row : 7;
+            streamWriter_write(writer, indexed.buffer + row*streamTestWidth, streamTestWidth, rows);
+        }
+        streamWriter_close(writer);
+
+        unsigned char* whole; unsigned char* strips; size_t wholeSize, stripsSize;
+        lodepng_load_file(&whole, &wholeSize, pamPath);
+        lodepng_load_file(&strips, &stripsSize, pngPath);
+        if (wholeSize != stripsSize || memcmp(whole, strips, wholeSize) != 0) errors++;
+        if (format == IMAGE_RAW) {
+            if (wholeSize != images_RAW_DATA_OFFSET + streamTestWidth*streamTestHeight) errors++;
+            else if (memcmp(whole+images_RAW_DATA_OFFSET, indexed.buffer, streamTestWidth*streamTestHeight) != 0) errors++;
+        } else if (format == IMAGE_PAM) {
+            image = readImage(pamPath);
+            if (image.width != streamTestWidth || image.height != streamTestHeight || image.channels != 3) {
+                errors++;
+            } else {
+                for (int i = 0; i < streamTestWidth*streamTestHeight; i++) {
+                    if (memcmp(image.buffer+i*3, indexed.pallet+indexed.buffer[i]*3, 3) != 0) errors++;
+                }
+            }
+            destroyImage(&image);
+        }
+        free(whole);
+        free(strips);
+    }
+    destroyIndexedImage(&indexed);
+    printf("# Write indexed pam, raw, and gif - Errors %i\n", errors);
+
+    streamReader_close(reader);
+    destroyImage(&strip);
+    remove(pamPath);
+    remove(pngPath);
+}
+#endif // _TESTS
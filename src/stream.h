@@ -0,0 +1,73 @@
+#ifndef __H_stream
+#define __H_stream
+
+#include "./images.h"
+#include "./gif.h"
+#include <stdio.h>
+
+//#define _TESTS
+
+// Readers and writers which only ever hold a strip of rows in memory, so images larger than memory can be reduced in two passes
+// Only binary PPM and PAM can be read a strip at a time, compressed formats are decoded by libraries which need the whole image
+
+// A binary PPM (P6) or PAM (P7) file with a maximum value of 255 and 3 or 4 channels, open at the next row to be read
+typedef struct StreamReader {
+    FILE* file;
+    unsigned width;
+    unsigned height;
+    unsigned channels;
+    long dataOffset;
+    unsigned row;
+} StreamReader;
+
+// Open a reader at the first row of an image, returns NULL if the file can not be opened or is not a supported PPM or PAM
+StreamReader* streamReader_open(const char* path);
+
+// Close the file of a reader and free it
+void streamReader_close(StreamReader* reader);
+
+// Create an image of the same width and channels as the reader with room for the given number of rows
+Image streamReader_newStrip(const StreamReader* reader, unsigned rows);
+
+// Read up to rows more rows into a strip made by streamReader_newStrip, no more rows are read than the strip was made for
+// The strip height is set to the number of rows read, which is 0 once every row has been read
+unsigned streamReader_read(StreamReader* reader, Image* strip, unsigned rows);
+
+// Move a reader back to its first row so the image can be read again
+void streamReader_rewind(StreamReader* reader);
+
+// An image which is written a strip of rows at a time, png rows are stored without compression as no streaming deflate is available
+// PAM and RAW rows are written as they are given, except indexed rows in a PAM which are expanded through the pallet
+// GIF rows are compressed as they are given, as LZW only needs the dictionary built from the rows before them
+typedef struct StreamWriter {
+    FILE* file;
+    ImageFormat format;
+    unsigned width;
+    unsigned height;
+    unsigned channels;
+    unsigned bitDepth;
+    unsigned row;
+    size_t lineSize;
+    unsigned adlerA;
+    unsigned adlerB;
+    unsigned char* buffer;
+    size_t bufferSize;
+    unsigned char pallet[images_MAX_PALLET*3];
+    GifEncoder* gif;
+} StreamWriter;
+
+// Open an image for writing, a channel count of 1 writes an indexed image using the pallet of the indexed image given
+// The output matches what writeIndexedImage and writeImage would write for the same format, other channel counts are written as RGB or RGBA
+StreamWriter* streamWriter_open(const char* path, ImageFormat format, unsigned width, unsigned height, unsigned channels, const IndexedImage* pallet);
+
+// Write the rows of a strip, which must have the channels the writer was opened with, indexed strips are one byte per pixel
+void streamWriter_write(StreamWriter* writer, const unsigned char* buffer, size_t stride, unsigned rows);
+
+// Finish the image and free the writer, every row of the image must have been written
+void streamWriter_close(StreamWriter* writer);
+
+#ifdef _TESTS
+void _test_stream();
+#endif // _TESTS
+
+#endif // __H_stream
@@ -1,5 +1,11 @@
 #include "./priorityQueue.h"
 #include "./hashMap.h"
+#include "./histogram.h"
+#include "./arena.h"
+#include "./pixels.h"
+#include "./images.h"
+#include "./stream.h"
+#include "./gif.h"
 
 int main() {
     
@@ -8,6 +14,21 @@ int main() {
 
     _test_hashMap();
     _test_stress_hashMap();
+    _test_large_hashMap();
+
+    _test_histogram();
+    _test_stress_histogram();
+
+    _test_arena();
+    _test_stress_arena();
+
+    _test_pixels();
+
+    _test_images();
+
+    _test_stream();
+
+    _test_gif();
 
     return 0;
 }
\ No newline at end of file